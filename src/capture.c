@@ -0,0 +1,210 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of jonny nor the name of any other
+ *    contributor may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY jonny AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL jonny OR ANY OTHER
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, 
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+ 
+#include <SDL/SDL.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+#include "display.h"
+#include "core.h"
+#include "stats.h"
+
+/* frames are copied into a ring of slots by the emulator, and written out
+ * by the capture thread. there is one of each, so the ring needs no lock:
+ * the emulator only moves head and the writer only moves tail. when the
+ * ring is full the frame is dropped rather than waiting for the disk. */
+#define CAPTURE_SLOTS		32
+
+typedef struct {
+	uint64_t clock;		/* emulated time the frame was finished */
+	Frame frame;
+} CaptureSlot;
+
+static void write_frame(const CaptureSlot *slot);
+static int capture_loop(void *data);
+
+static CaptureSlot *slots = NULL;
+static volatile unsigned int head;
+static volatile unsigned int tail;
+static SDL_sem *frame_sem;
+static SDL_Thread *thread = NULL;
+static volatile int is_capture_quit;
+
+static FILE *file = NULL;
+static FILE *times_file = NULL;
+static int is_y4m;
+static SDL_PixelFormat format;
+static uint64_t frames_written;
+
+static Counter capture_counter = { "frames to capture" };
+static Counter capture_drop_counter = { "capture frames dropped", .of = &capture_counter };
+static Counter capture_write_counter = { "capture frames written" };
+
+extern Display display;
+
+void capture_start(const char *path) {
+	const char *ext = strrchr(path, '.');
+	char *times_path;
+	if (thread != NULL)
+		capture_stop();
+	is_y4m = (ext != NULL) && (strcmp(ext, ".y4m") == 0);
+	file = fopen(path, "wb");
+	if (file == NULL) {
+		fprintf(stderr, "could not open capture file %s\n", path);
+		exit(1);
+	}
+	if (is_y4m) {
+		/* the lcd runs at 4194304 / 70224 frames per second */
+		fprintf(file, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C444\n", DISPLAY_W,
+				DISPLAY_H, MASTER_CLOCK_HZ, 70224);
+	} else {
+		times_path = malloc(strlen(path) + sizeof(".times"));
+		sprintf(times_path, "%s.times", path);
+		times_file = fopen(times_path, "w");
+		if (times_file == NULL) {
+			fprintf(stderr, "could not open capture file %s\n", times_path);
+			exit(1);
+		}
+		free(times_path);
+	}
+	if (slots == NULL) {
+		slots = malloc(CAPTURE_SLOTS * sizeof(CaptureSlot));
+		stats_register(&capture_counter);
+		stats_register(&capture_drop_counter);
+		stats_register(&capture_write_counter);
+	}
+	format = display.format;
+	head = tail = 0;
+	frames_written = 0;
+	is_capture_quit = 0;
+	frame_sem = SDL_CreateSemaphore(0);
+	thread = SDL_CreateThread(capture_loop, NULL);
+	printf("capturing %s to %s\n", is_y4m ? "y4m" : "raw rgb", path);
+}
+
+/* writes out the frames still queued, then closes the file */
+void capture_stop(void) {
+	if (thread == NULL)
+		return;
+	is_capture_quit = 1;
+	SDL_SemPost(frame_sem);
+	SDL_WaitThread(thread, NULL);
+	thread = NULL;
+	SDL_DestroySemaphore(frame_sem);
+	fclose(file);
+	file = NULL;
+	if (times_file != NULL) {
+		fclose(times_file);
+		times_file = NULL;
+	}
+	printf("capture: %llu frames written\n", (unsigned long long)frames_written);
+}
+
+int capture_is_active(void) {
+	return thread != NULL;
+}
+
+/* called by the display with each finished frame */
+void capture_frame(const Frame *frame, uint64_t clock) {
+	uint64_t start;
+	CaptureSlot *slot;
+	if (thread == NULL)
+		return;
+	start = stats_now();
+	if (head - tail >= CAPTURE_SLOTS) {
+		counter_inc(&capture_drop_counter);
+		counter_inc(&capture_counter);
+		return;
+	}
+	slot = &slots[head % CAPTURE_SLOTS];
+	slot->clock = clock;
+	/* only the palettes the frame used are copied */
+	memcpy(&slot->frame, frame, display_frame_size(frame));
+	/* the slot must be filled before the writer can see it */
+	__sync_synchronize();
+	++head;
+	counter_stop(&capture_counter, start);
+	SDL_SemPost(frame_sem);
+}
+
+static int capture_loop(void *data) {
+	uint64_t start;
+	while (1) {
+		SDL_SemWait(frame_sem);
+		while (tail != head) {
+			__sync_synchronize();
+			start = stats_now();
+			write_frame(&slots[tail % CAPTURE_SLOTS]);
+			counter_stop(&capture_write_counter, start);
+			/* done with the slot: the emulator may reuse it */
+			__sync_synchronize();
+			++tail;
+		}
+		if (is_capture_quit)
+			break;
+	}
+	return 0;
+}
+
+static void write_frame(const CaptureSlot *slot) {
+	static Byte out[DISPLAY_H * DISPLAY_W * 3];
+	Byte *p_y = out, *p_u = out + (DISPLAY_H * DISPLAY_W);
+	Byte *p_v = p_u + (DISPLAY_H * DISPLAY_W), *p = out;
+	int x, y, r, g, b;
+	uint64_t ns = slot->clock * 1000000000 / MASTER_CLOCK_HZ;
+	Colour row[DISPLAY_W], c;
+	for (y = 0; y < DISPLAY_H; y++) {
+		display_resolve_line(&slot->frame, y, row);
+		for (x = 0; x < DISPLAY_W; x++) {
+			c = row[x];
+			r = (c >> format.Rshift) & 0xff;
+			g = (c >> format.Gshift) & 0xff;
+			b = (c >> format.Bshift) & 0xff;
+			if (is_y4m) {
+				/* bt.601, studio range */
+				*p_y++ = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+				*p_u++ = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+				*p_v++ = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+			} else {
+				*p++ = r;
+				*p++ = g;
+				*p++ = b;
+			}
+		}
+	}
+	/* frame times are in emulated ns: frames are skipped while the lcd
+	 * is off, so they are not always evenly spaced */
+	if (is_y4m)
+		fprintf(file, "FRAME Xt=%llu\n", (unsigned long long)ns);
+	else
+		fprintf(times_file, "%llu %llu\n", (unsigned long long)frames_written,
+				(unsigned long long)ns);
+	if (fwrite(out, sizeof(out), 1, file) != 1)
+		fprintf(stderr, "capture: write failed\n");
+	++frames_written;
+}
@@ -663,6 +663,8 @@ void cart_save(void) {
 	save_uint("rom_block", cart.rom_block);
 	save_uint("ram_bank", cart.ram_bank);
 	save_uint("mbc_mode", cart.mbc_mode);
+	if (cart.mbc == 3)
+		rtc_save();
 }
 
 void cart_load(void) {
@@ -674,6 +676,8 @@ void cart_load(void) {
 	cart.rom_block = load_uint("rom_block");
 	cart.ram_bank = load_uint("ram_bank");
 	cart.mbc_mode = load_uint("mbc_mode");
+	if (cart.mbc == 3)
+		rtc_load();
 	set_switchable_rom();
 	set_switchable_ram();
 }
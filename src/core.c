@@ -36,6 +36,7 @@
 #include "memory.h"
 #include "debug.h"
 #include "save.h"
+#include "timer.h"
 
 #define	REG_A   (core.reg_af.b.h)
 #define	REG_F   (core.reg_af.b.l) 	// must be set manually
@@ -59,6 +60,7 @@
 
 static inline void handle_interrupts();
 static inline void handle_interrupt(Byte interrupt, Word Vector, Byte reg_if, Byte reg_ie);
+static inline void advance_clock(unsigned int cycles);
 
 
 /* arithmetic */
@@ -103,8 +105,6 @@ static inline void ret();
 extern int console;
 extern int console_mode;
 
-extern int sound_cycles;
-
 CoreState core;
 int debugging = 0;
 
@@ -112,7 +112,8 @@ int execute_cycles(int max_cycles) {
 	int cycles = 0;
 	int total_cycles = 0;
 	Byte opcode;
-	while (total_cycles < max_cycles) {
+	core.is_slice_ended = 0;
+	while ((total_cycles < max_cycles) && (!core.is_slice_ended)) {
 		cycles = 0;
 		
 		/* check for interrupts */
@@ -124,7 +125,7 @@ int execute_cycles(int max_cycles) {
 				core.is_halted = 0;
 			}
 */
-			sound_cycles += max_cycles - total_cycles;
+			advance_clock(max_cycles - total_cycles);
 			return max_cycles;
 		}
 
@@ -1378,6 +1379,9 @@ int execute_cycles(int max_cycles) {
 				if ((read_io(HWREG_KEY1) & 0x01) && 
 						(console_mode = MODE_GBC_ENABLED)) {
 				fprintf(stderr, "speed switch");
+					/* the timer counts cpu cycles, so it must be brought up
+					 * to date at the old speed before switching */
+					timer_sync();
 					if (core.frequency == FREQ_NORMAL) {
 						core.frequency = FREQ_DOUBLE;
 						write_io(HWREG_KEY1, 0x80);
@@ -1663,7 +1667,7 @@ int execute_cycles(int max_cycles) {
 			dump_state();
 			
 		total_cycles += cycles;
-		sound_cycles += cycles;
+		advance_clock(cycles);
 		
 	}
 
@@ -1747,6 +1751,7 @@ void core_reset() {
 	write_io(HWREG_HDMA5, 	0xff);
 	
 	core.frequency = FREQ_NORMAL;
+	core.clock = 0;
 }
 
 void dump_state() {
@@ -1820,6 +1825,12 @@ static inline void handle_interrupt(Byte interrupt, Word Vector, Byte reg_if, By
 	}
 }
 
+/* converts cpu cycles at the current speed to master clock ticks.
+ * instructions always take a multiple of 4 cycles, so nothing is lost. */
+static inline void advance_clock(unsigned int cycles) {
+	core.clock += cycles >> (core.frequency - 1);
+}
+
 // ADD
 static inline Byte add_bbb(Byte a, Byte b) {
 	Byte temp = a + b;
@@ -2288,6 +2299,7 @@ void core_save() {
 	save_int("is_stopped", core.is_stopped);
 	save_int("ime", core.ime);
 	save_uint("frequency", core.frequency);
+	save_uint64("clock", core.clock);
 	
 	save_int("console", console);
 	save_int("console_mode", console_mode);
@@ -2313,6 +2325,9 @@ void core_load() {
 	core.is_stopped = load_int("is_stopped");
 	core.ime = load_int("ime");
 	core.frequency = load_uint("frequency");
+	/* older states have no clock: carry on from the current one */
+	if (load_exists("clock"))
+		core.clock = load_uint64("clock");
 	
 	console = load_int("console");
 	console_mode = load_int("console_mode");
@@ -44,6 +44,10 @@
 #define FREQ_NORMAL	1
 #define FREQ_DOUBLE	2
 
+/* the master clock ticks at the normal speed cpu frequency, regardless of
+ * the current cpu speed. in double speed mode a cpu cycle is half a tick. */
+#define MASTER_CLOCK_HZ	4194304
+
 typedef struct {
 		/* CPU registers */
 		union UWord reg_af, reg_bc, reg_de, reg_hl;
@@ -53,6 +57,10 @@ typedef struct {
 		int ei;
 		int is_halted, is_stopped, ime;
 		unsigned int frequency;
+		/* master clock: ticks since reset. never goes backwards */
+		uint64_t clock;
+		/* set when the predicted next event may have moved */
+		int is_slice_ended;
 } CoreState;
 
 int execute_cycles(int max_cycles);
@@ -61,6 +69,13 @@ void dump_state(void);
 void core_save(void);
 void core_load(void);
 
+/* makes execute_cycles() return after the current instruction. called
+ * when a register write changes when the next interrupt can happen */
+static inline void end_slice(void) {
+	extern CoreState core;
+	core.is_slice_ended = 1;
+}
+
 static inline void raise_int(Byte interrupt) {
 	writeb(HWREG_IF, readb(HWREG_IF) | interrupt);
 }
@@ -28,25 +28,51 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
+#include <stddef.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "gbem.h"
 #include "display.h"
 #include "memory.h"
 #include "core.h"
 #include "save.h"
 #include "scale.h"
+#include "filter.h"
+#include "video.h"
+#include "capture.h"
+#include "tileview.h"
+#include "fifo.h"
+#include "stats.h"
 
 
 #define	ALL		-1
 
-static void draw_scan_line(Byte ly);
-static void clear_scan_line();
-static void draw_background(const Byte lcdc, const Byte ly);
-static void draw_gbc_background(const Byte lcdc, const Byte ly);
-static void draw_window(const Byte lcdc, const Byte ly);
-static void draw_gbc_window(const Byte lcdc, const Byte ly);
+static void display_update(unsigned int cycles);
+static void frame_done(void);
+static void frame_clear(Frame *frame);
+static void frame_palettes(unsigned int first, unsigned int end, const Palette *pals);
+static void palette_changed(const unsigned int n);
+static void line_end(const Byte lcdc, const Byte ly);
+static void line_frame(void);
+static void clear_scan_line(Byte *scan_line);
+static void draw_background(Byte *scan_line, const LineRegs *regs, const Byte ly);
+static void draw_window(Byte *scan_line, const LineRegs *regs, const Byte ly);
+static const Byte *get_bg_row(const int map, const Byte lcdc, const Byte y);
+static void bg_row_build(Byte *px, const int map, const Byte lcdc, const Byte y);
+static void bg_rows_dirty(void);
 static void launch_hdma(int length);
-static void draw_sprites(const Byte lcdc, const Byte ly);
-static void draw_gbc_sprites(const Byte lcdc, const Byte ly);
+static void draw_sprites(Byte *scan_line, const LineRegs *regs, const Byte ly);
+static void draw_gbc_sprites(Byte *scan_line, const LineRegs *regs, const Byte ly);
+static void log_line(const Byte lcdc, const Byte ly);
+static void draw_line(Byte *scan_line, const Byte ly);
+static int render_loop(void *data);
+static void draw_lines(unsigned int first, unsigned int end);
+static int raster_loop(void *data);
 static inline Byte get_sprite_x(const unsigned int sprite);
 static inline Byte get_sprite_y(const unsigned int sprite);
 static inline Byte get_sprite_pattern(const unsigned int sprite);
@@ -60,52 +86,185 @@ static void fill_rectangle(SDL_Surface *surface, const int x, const int y,
 						const unsigned int colour);
 
 static void tile_init(Tile *t, Byte* vram_px, Tile *next);
-static void tile_fini(Tile *t);
+static void tile_lut_init(void);
 static void tile_regenerate(Tile *t, const int flip);
-static void tile_blit(Tile *t, const int x, const int line, const int flip, const int pal, const int priority);
-static void sprite_blit(Tile *t, const int x, const int line, const int flip, const int pal, const int priority, const int h);
+static void sprite_blit(Byte *scan_line, Tile *t, const int x, const int line, const int flip, const int pal, const int priority, const int h);
 
 static Colour map_rgb(uint8_t r, uint8_t g, uint8_t b);
-static Colour translate_gbc_rgb(uint8_t r, uint8_t g, uint8_t b);
-
-enum { TILE_PALETTE 	= 0x07 };
-enum { TILE_VRAM_BANK 	= 0x08 };
-enum { TILE_X_FLIP 		= 0x20 };
-enum { TILE_Y_FLIP 		= 0x40 };
-enum { TILE_PRIORITY 	= 0x80 };
+static inline Colour gbc_colour(const Byte *p);
+static void gbc_colours_update(void);
+static void gbc_palettes_refresh(void);
 
 Display display;
+
+/* a bit plane byte spread out to one byte per pixel, leftmost pixel first.
+ * a row of colour codes is plane_lut[low] | (plane_lut[high] << 1) */
+static uint64_t plane_lut[256];
+/* bit plane bytes mirrored, for x flipped tiles */
+static Byte reverse_lut[256];
+
+static Counter decode_counter = { "tile decodes" };
+static Counter render_counter = { "lines rendered" };
+static Counter blank_counter = { "blank frames (lcd off)" };
+
+/* frames are triple buffered between the emulator, which draws into
+ * frames[draw_index], and the render thread, which presents
+ * frames[present_index]. ready_index is the frame between them, flagged
+ * with FRAME_NEW until it is taken for presentation. */
+#define FRAME_COUNT			3
+#define FRAME_INDEX			0x03
+#define FRAME_NEW			0x04
+static Frame *frames[FRAME_COUNT];
+static uint64_t frame_time[FRAME_COUNT];
+static int draw_index;
+static int present_index;
+static volatile int ready_index;
+static SDL_Thread *render_thread = NULL;
+static volatile int is_render_quit;
+static SDL_sem *frame_sem;
+static SDL_sem *video_sem;
+
+/* raster threads: a worker owns a run of lines, packed as the next line
+ * | the end line << 16, and steals from the others' runs when its own is
+ * done. workers[0] is the emulation thread. */
+#define MAX_RASTER_THREADS	8
+#define MIN_PARALLEL_LINES	16
+#define BENCHMARK_FRAMES	100
+typedef struct {
+	volatile uint32_t range;
+	SDL_sem *start_sem;
+	SDL_Thread *thread;
+} RasterWorker;
+static RasterWorker workers[MAX_RASTER_THREADS];
+static void raster_work(RasterWorker *w);
+static int take_line(RasterWorker *w);
+static int steal_lines(RasterWorker *w);
+static unsigned int raster_threads = 1;
+static unsigned int raster_threads_started = 1;
+static volatile int is_raster_quit;
+static SDL_sem *raster_done_sem;
+
+static Counter handoff_counter = { "frame handoffs (main thread)" };
+static Counter latency_counter = { "frames presented (latency)" };
+static Counter drop_counter = { "frames dropped" };
+
+/* decoded background and window rows, one per row of each tile map.
+ * tag is the tile map row's version << 1 | the tile data select bit the
+ * row was decoded with. */
+typedef struct {
+	volatile unsigned int tag;
+	Byte px[BG_W];
+} BgRow;
+static BgRow bg_rows[2][BG_H];
+
+static Counter row_lookup_counter = { "bg row lookups" };
+static Counter row_hit_counter = { "bg row cache hits", .of = &row_lookup_counter };
+static Counter row_decode_counter = { "bg row decodes" };
+
+/* the sprites on each line, at most MAX_SPRITES_PER_LINE of them, highest
+ * priority first. rebuilt from oam before drawing whenever oam or the
+ * sprite height has changed. */
+typedef struct {
+	Byte count;
+	Byte sprites[MAX_SPRITES_PER_LINE];
+} SpriteLine;
+static SpriteLine sprite_index[DISPLAY_H];
+static void sprite_index_build(void);
+
+static Counter sprite_index_counter = { "sprite index rebuilds" };
+
+/* how the gbc lcd is imitated: the lcd's gamma, a matrix mixing its red,
+ * green and blue, and a brightness. a NULL matrix is the plain r * 8
+ * mapping, which is far too vibrant. */
+typedef struct {
+	const char *name;
+	double gamma;
+	const double (*matrix)[3];
+	double lum;
+} ColourProfile;
+
+static const double gbc_matrix[3][3] = {
+	{ 0.82, 0.125, 0.195 },
+	{ 0.24, 0.665, 0.075 },
+	{ -0.06, 0.21, 0.73 }
+};
+/* the gba lcd is darker, and mixes its channels a little more */
+static const double gba_matrix[3][3] = {
+	{ 0.80, 0.135, 0.195 },
+	{ 0.275, 0.64, 0.155 },
+	{ -0.075, 0.225, 0.65 }
+};
+static const ColourProfile colour_profiles[COLOUR_PROFILES] = {
+	{ "none", 1.0, NULL, 1.0 },
+	{ "gbc lcd", 2.2, gbc_matrix, 0.94 },
+	{ "gba lcd", 2.8, gba_matrix, 0.93 }
+};
+#define HOST_GAMMA			2.2
+
+/* every rgb555 colour a gbc palette can hold, as a host pixel. built for
+ * one colour profile and pixel format, so a palette write is a lookup */
+static Colour gbc_colours[1 << 15];
+static unsigned int colour_profile = COLOUR_GBC;
+static int gbc_colours_profile = -1;
+static Uint32 gbc_colours_masks[3];
+
+/* rendering registers of the lines waiting to be drawn */
+static LineRegs line_log[DISPLAY_H];
+
+/* a ppu is told when mode 3 of a line starts, how far through it the lcd
+ * has got whenever the display is synced, and when it ends. it is also
+ * told when a palette (sprite palettes from 8) has changed, and can draw
+ * a whole frame again for the benchmark, and reset when it is switched
+ * to. the line ppu only needs the end of the line, and draws it, or logs
+ * it for later, from the registers as they are then. */
+typedef struct {
+	const char *name;
+	void (*reset)(void);
+	void (*line_start)(const Byte ly);
+	void (*line_run)(const Byte ly, const unsigned int dot);
+	void (*line_end)(const Byte lcdc, const Byte ly);
+	void (*palette)(const unsigned int n);
+	void (*frame)(void);
+} Ppu;
+
+static const Ppu ppus[PPUS] = {
+	{ "line", NULL, NULL, NULL, line_end, NULL, line_frame },
+	{ "fifo", fifo_reset, fifo_line_start, fifo_line_run, fifo_line_end, fifo_palette, fifo_frame }
+};
+
+extern CoreState core;
 extern int console;
 extern int console_mode;
 
 void display_init(void) {
+	SDL_Surface *surface;
 	display.x_res = DISPLAY_W * 4;
 	display.y_res = DISPLAY_H * 4;
 	display.bpp = 32;
 
-	display.screen = SDL_SetVideoMode(display.x_res, display.y_res, display.bpp, SDL_SWSURFACE);
-	if (display.screen == NULL) {
-		fprintf(stderr, "video mode initialisation failed\n");
+	/* frames are resolved into surfaces of sdl's default 32 bit format */
+	surface = SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, display.bpp, 0, 0, 0, 0);
+	if (surface == NULL) {
+		fprintf(stderr, "could not create surface\n");
 		exit(1);
 	}
-	
+	display.format = *surface->format;
+	display.format.palette = NULL;
+	SDL_FreeSurface(surface);
+
+	video_init();
+
 	#ifdef WINDOWS
 		// redirecting the standard input/output to the console 
 		// is required with windows.
 		activate_console(); 
 	#endif // WINDOWS
 
-	printf("sdl video initialised.\n");
-	SDL_WM_SetCaption("gbem", "gbem");
+	display.frame = malloc(sizeof(Frame));
+	frame_clear(display.frame);
 
-	display.display = SDL_CreateRGBSurface(SDL_SWSURFACE, 
-                                 DISPLAY_W, DISPLAY_H, display.bpp, 0, 0, 0, 0);
-	if (display.display == NULL) {
-		fprintf(stderr, "could not create surface\n");
-		exit(1);
-	}
-
-	//display.display = SDL_DisplayFormat(display.display);
+	display.bg_pal = &display.palettes[0];
+	display.spr_pal = &display.palettes[8];
 
 	display.mono_colours[0] = map_rgb(0xff, 0xff, 0xff);
 	display.mono_colours[1] = map_rgb(0xaa, 0xaa, 0xaa);
@@ -114,8 +273,27 @@ void display_init(void) {
 	
 	display.gbc_bg_pal_mem = malloc(64 * sizeof(Byte));
 	display.gbc_spr_pal_mem = malloc(64 * sizeof(Byte));
-	
-	display.scan_line = malloc(DISPLAY_W * sizeof(Byte));
+	gbc_colours_update();
+
+	tile_lut_init();
+	scale_init();
+	filter_init();
+	stats_register(&decode_counter);
+	stats_register(&render_counter);
+	stats_register(&blank_counter);
+	stats_register(&handoff_counter);
+	stats_register(&latency_counter);
+	stats_register(&drop_counter);
+	stats_register(&sprite_index_counter);
+	stats_register(&row_lookup_counter);
+	stats_register(&row_hit_counter);
+	stats_register(&row_decode_counter);
+
+	frames[0] = display.frame;
+	draw_index = 0;
+	frame_sem = SDL_CreateSemaphore(0);
+	video_sem = SDL_CreateSemaphore(1);
+	raster_done_sem = SDL_CreateSemaphore(0);
 	
 	display.vram = NULL;
 	display.oam = NULL;
@@ -125,28 +303,34 @@ void display_init(void) {
 
 void display_fini(void) {
 	int i;
-	for (i = 0; i < display.cache_size; i++) {
-		tile_fini(&display.tiles_tdt_0[i]);
+	display_set_threaded(0);
+	is_raster_quit = 1;
+	for (i = 1; i < raster_threads_started; i++) {
+		SDL_SemPost(workers[i].start_sem);
+		SDL_WaitThread(workers[i].thread, NULL);
+		SDL_DestroySemaphore(workers[i].start_sem);
 	}
-	for (i = 0; i < display.cache_size; i++) {
-		tile_fini(&display.tiles_tdt_1[i]);
+	SDL_DestroySemaphore(raster_done_sem);
+	filter_fini();
+	video_fini();
+	for (i = 0; i < FRAME_COUNT; i++) {
+		if (frames[i] != NULL)
+			free(frames[i]);
 	}
-	SDL_FreeSurface(display.display);
+	SDL_DestroySemaphore(frame_sem);
+	SDL_DestroySemaphore(video_sem);
 	if (display.vram != NULL)
 		free(display.vram);
 	if (display.oam != NULL)
 		free(display.oam);
-	free(display.tiles_tdt_0);
-	free(display.tiles_tdt_1);
-	
 	free(display.gbc_bg_pal_mem);
 	free(display.gbc_spr_pal_mem);
-	free(display.scan_line);
 }
 
 
 void display_reset(void) {
 	int i;
+	display.log_start = display.log_end = 0;
 	if ((console == CONSOLE_GBC) || (console == CONSOLE_GBA)) {
 		display.vram = malloc(sizeof(Byte) * VRAM_SIZE_GBC);
 		memset(display.vram, 0, VRAM_SIZE_GBC);
@@ -167,9 +351,6 @@ void display_reset(void) {
 		display.cache_size = 256;
 	}
 
-	display.tiles_tdt_0 = malloc(sizeof(Tile) * display.cache_size);
-	display.tiles_tdt_1 = malloc(sizeof(Tile) * display.cache_size);
-	
 	for (i = 0; i < display.cache_size; i++) {
 		tile_init(&display.tiles_tdt_0[i], display.vram + ((i % 256) * 16) + ((i / 256) * 0x2000), &display.tiles_tdt_0[i + 1]);
 		tile_init(&display.tiles_tdt_1[i], display.vram + ((i % 256) * 16) + 0x0800 + ((i / 256) * 0x2000), &display.tiles_tdt_1[i + 1]);
@@ -189,10 +370,15 @@ void display_reset(void) {
 	}
 
 	display.sprite_height = 8;
+	display.is_sprite_index_dirty = 1;
+	bg_rows_dirty();
 	display.cycles = 0;	
+	display.last_sync = core.clock;
 	display.is_hdma_active = 0;
-	SDL_FillRect(display.display, NULL, SDL_MapRGB(display.display->format, 0xff, 0xff, 0xff));
-	SDL_FillRect(display.screen, NULL, SDL_MapRGB(display.screen->format, 0xff, 0xff, 0xff));
+	frame_clear(display.frame);
+	display_lock_video();
+	video_clear();
+	display_unlock_video();
 }
 
 void set_vram_bank(unsigned int bank) {
@@ -201,17 +387,52 @@ void set_vram_bank(unsigned int bank) {
 }
 
 void set_lcdc(Byte value) {
-	/* if lcd is being turned on/off set ly to 0 and blank the screen */
+	display_sync();
+	display_flush();
+	/* if lcd is being turned on/off set ly to 0 and blank the screen. the
+	 * lcd stays in hblank at line 0 while it is off, and starts line 0
+	 * afresh when it is turned on */
 	if ((value & 0x80) != (read_io(HWREG_LCDC) & 0x80)) {
 		write_io(HWREG_LY, 0);
-		SDL_FillRect(display.display, NULL, SDL_MapRGB(display.display->format, 0xff, 0xff, 0xff));
+		write_io(HWREG_STAT, (read_io(HWREG_STAT) & ~STAT_MODES) | STAT_MODE_HBLANK);
+		display.cycles = 0;
+		frame_clear(display.frame);
 	}
 
 	write_io(HWREG_LCDC, value);
+	end_slice();
+}
+
+/* catches the display up with the master clock. the lcd runs at the same
+ * speed in both cpu speed modes, so master clock ticks are used directly. */
+void display_sync(void) {
+	unsigned int ticks = (unsigned int)(core.clock - display.last_sync);
+	display.last_sync = core.clock;
+	if (ticks != 0)
+		display_update(ticks);
+}
+
+/* returns the master clock ticks until the lcd next changes mode or line,
+ * which is when it can next raise an interrupt */
+unsigned int display_next_event(void) {
+	unsigned int cycles = display.cycles + (unsigned int)(core.clock - display.last_sync);
+	unsigned int next = HBLANK_CYCLES;
+	/* while the lcd is off, the only event is the next blank frame */
+	if (!(read_io(HWREG_LCDC) & 0x80))
+		next = FRAME_CYCLES;
+	else if (read_io(HWREG_LY) < DISPLAY_H) {
+		if (cycles < OAM_CYCLES)
+			next = OAM_CYCLES;
+		else if (cycles < OAM_VRAM_CYCLES)
+			next = OAM_VRAM_CYCLES;
+	}
+	if (cycles >= next)
+		return 1;
+	return next - cycles;
 }
 
 /* FIXME: if lots of cycles have passed, modes could be skipped! (is this still true?) */
-void display_update(unsigned int cycles) {
+static void display_update(unsigned int cycles) {
 	Byte ly, stat, lcdc, hdma_length;
 	int i;
 	display.cycles += cycles;
@@ -219,44 +440,14 @@ void display_update(unsigned int cycles) {
 	stat = read_io(HWREG_STAT);
 	lcdc = read_io(HWREG_LCDC);
 	if (!(lcdc & 0x80)) {
-		lcd_off_start:
-		if (display.cycles < OAM_CYCLES) {
-			/* check that we are not already in oam */
-			if ((stat & STAT_MODES) != STAT_MODE_OAM) {
-				/* set the mode flag in STAT */
-				stat = (stat & (~STAT_MODES)) | STAT_MODE_OAM;
-				/* if oam stat interrupt is enabled, raise the interrupt */
-				if (stat & STAT_INT_OAM) {
-					raise_int(INT_STAT);
-				}
-			}
-		} else
-		/* is the lcd reading from oam and vram? */
-		if (display.cycles < OAM_VRAM_CYCLES) {
-			/* check that we are not already in oam / vram */
-			if ((stat & STAT_MODES) != STAT_MODE_OAM_VRAM) {
-				/* set the mode flag in STAT */
-				stat = (stat & (~STAT_MODES)) | STAT_MODE_OAM_VRAM;
-			}
-		} else 
-		/* is the lcd in hblank? */
-		if (display.cycles < HBLANK_CYCLES) {
-			/* check that we are not already in hblank */
-			if ((stat & STAT_MODES) != STAT_MODE_HBLANK) {
-				/* set the mode flag in STAT */
-				stat = (stat & (~STAT_MODES)) | STAT_MODE_HBLANK;
-				/* if hblank stat interrupt is enabled, raise the interrupt */
-				if (stat & STAT_INT_HBLANK) {
-					raise_int(INT_STAT);
-				}
-			}
-		/* has the lcd finished hblank? */
-		} else {
-			display.cycles -= HBLANK_CYCLES;
-			goto lcd_off_start;
+		/* the lcd is off, and frozen until set_lcdc() turns it back on.
+		 * blank frames still go out at the usual rate, and cost nothing
+		 * to present after the first */
+		while (display.cycles >= FRAME_CYCLES) {
+			display.cycles -= FRAME_CYCLES;
+			counter_inc(&blank_counter);
+			frame_done();
 		}
-		write_io(HWREG_LY, ly);
-		write_io(HWREG_STAT, stat);
 		return;
 	}
 	
@@ -281,7 +472,11 @@ void display_update(unsigned int cycles) {
 			if ((stat & STAT_MODES) != STAT_MODE_OAM_VRAM) {
 				/* set the mode flag in STAT */
 				stat = (stat & (~STAT_MODES)) | STAT_MODE_OAM_VRAM;
+				if (ppus[display.ppu].line_start != NULL)
+					ppus[display.ppu].line_start(ly);
 			}
+			if (ppus[display.ppu].line_run != NULL)
+				ppus[display.ppu].line_run(ly, display.cycles - OAM_CYCLES);
 		} else 
 		/* is the lcd in hblank? */
 		if (display.cycles < HBLANK_CYCLES) {
@@ -293,27 +488,7 @@ void display_update(unsigned int cycles) {
 				if (stat & STAT_INT_HBLANK) {
 					raise_int(INT_STAT);
 				}
-				/* draw the line */
-				if (console_mode == MODE_GBC_ENABLED) {
-					if (lcdc & 0x01)
-						draw_gbc_background(lcdc, ly);
-					else
-						clear_scan_line();
-					if (lcdc & 0x20)
-						draw_gbc_window(lcdc, ly);
-					if (lcdc & 0x02)
-						draw_gbc_sprites(lcdc, ly);
-				} else {
-					if (lcdc & 0x01)
-						draw_background(lcdc, ly);
-					else
-						clear_scan_line();
-					if (lcdc & 0x20)
-						draw_window(lcdc, ly);
-					if (lcdc & 0x02)
-						draw_sprites(lcdc, ly);
-				}
-				draw_scan_line(ly);
+				ppus[display.ppu].line_end(lcdc, ly);
 			}
 		/* has the lcd finished hblank? */
 		} else {
@@ -340,6 +515,8 @@ void display_update(unsigned int cycles) {
 		/* in vblank */
 		/* check that we are not already in vblank */
 		if ((stat & STAT_MODES) != STAT_MODE_VBLANK) {
+			/* the frame is complete: draw what is left of it */
+			display_flush();
 			/* set the mode flag in STAT */
 			stat = (stat & (~STAT_MODES)) | STAT_MODE_VBLANK;
 			/* if vblank stat interrupt is enabled, raise the interrupt */
@@ -356,13 +533,11 @@ void display_update(unsigned int cycles) {
 			if (ly == 154) {
 				ly = 0;
 				stat = check_coincidence(ly, stat);
-				draw_frame();
-				SDL_FillRect(display.display, NULL, SDL_MapRGB(display.display->format, 0xff, 0xff, 0xff));
-				//new_frame();
-				if (lcdc & 0x04)
-					display.sprite_height = 16;
-				else
-					display.sprite_height = 8;
+				frame_done();
+				if ((lcdc & 0x04 ? 16 : 8) != display.sprite_height) {
+					display.sprite_height = lcdc & 0x04 ? 16 : 8;
+					display.is_sprite_index_dirty = 1;
+				}
 			}
 			goto start;
 		}
@@ -371,6 +546,13 @@ void display_update(unsigned int cycles) {
 	write_io(HWREG_STAT, stat);
 }
 
+/* hands the finished frame over and starts a blank one */
+static void frame_done(void) {
+	draw_frame();
+	frame_clear(display.frame);
+	new_frame();
+}
+
 Byte check_coincidence(Byte ly, Byte stat) {
 	if (ly == read_io(HWREG_LYC)) {
 		/* check that this a new coincidence */
@@ -385,258 +567,664 @@ Byte check_coincidence(Byte ly, Byte stat) {
 	return stat;
 }
 
-static void draw_scan_line(Byte ly) {
-	int i;
-	Byte code;
-	for (i = 0; i < DISPLAY_W; i++) {
-		code = display.scan_line[i];
-		if (code & 0x20)
-			put_pixel(display.display, i, ly, display.spr_pal[(code >> 2) & 0x07].colour[code & 0x03]);
-		else
-			put_pixel(display.display, i, ly, display.bg_pal[(code >> 2) & 0x07].colour[code & 0x03]);
+/* turns line ly of frame into colours in row. with avx2, eight pixels at
+ * a time are gathered from the line's palettes. */
+void display_resolve_line(const Frame *frame, const int ly, Colour *row) {
+	const Byte *code = frame->codes[ly];
+	const Palette *pal;
+	int i = 0;
+#ifdef __AVX2__
+	const __m256i mask = _mm256_set1_epi32(0x3f);
+	__m256i index;
+#endif
+	if (frame->line_pals[ly] == LINE_BLANK) {
+		for (i = 0; i < DISPLAY_W; i++)
+			row[i] = display.mono_colours[0];
+		return;
+	}
+	pal = frame->pals[frame->line_pals[ly]];
+#ifdef __AVX2__
+	for (; i + 8 <= DISPLAY_W; i += 8) {
+		index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(code + i)));
+		index = _mm256_and_si256(index, mask);
+		_mm256_storeu_si256((__m256i *)(row + i),
+				_mm256_i32gather_epi32((const int *)pal, index, sizeof(Colour)));
 	}
+#endif
+	for (; i < DISPLAY_W; i++)
+		row[i] = pal[(code[i] >> 2) & 0x0f].colour[code[i] & 0x03];
 }
 
-static void clear_scan_line() {
-	memset(display.scan_line, 0x00, DISPLAY_W);
+/* turns all of frame into colours in surface, which must be at least
+ * DISPLAY_W x DISPLAY_H and in display.format */
+void display_resolve(const Frame *frame, SDL_Surface *surface) {
+	int ly;
+	for (ly = 0; ly < DISPLAY_H; ly++)
+		display_resolve_line(frame, ly, (Colour *)((Uint8 *)surface->pixels + (ly * surface->pitch)));
 }
 
-void draw_frame() {
-	scale_nn4x(display.display, display.screen);
-	SDL_Flip(display.screen);
-}
-
-static void draw_background(const Byte lcdc, const Byte ly) {
-    unsigned int x;
-	Byte scx = read_io(HWREG_SCX);
-    Byte scy = read_io(HWREG_SCY);
-    Byte wx = read_io(HWREG_WX);
-    Byte wy = read_io(HWREG_WY);
-	unsigned int tile_code;
-	Byte offset_x = scx & 0x07;
-	Byte offset_y = (ly + scy) & 0x07;
-	Byte bg_y = (ly + scy) & 0xFF;
-	Byte tile_x;
-	Byte tile_y;
-	int screen_x;
-	unsigned int x_pos;
-	for (x = scx; x <= (scx + (unsigned)DISPLAY_W); x += 8) {
-		Byte bg_x = x & 0xFF;
-		tile_x = (bg_x / 8);
-		tile_y = (bg_y / 8);
-		screen_x = scx / 8;
-		x_pos = x - scx - offset_x;
-		/* dont draw over the window! */
-		if ((lcdc & 0x20) && (x_pos + 7 >= wx) && (ly >= wy))
-			continue;
-		if ((lcdc & 0x08) == 0) {
-			// tile map is at 0x9800-0x9BFF bank 0
-			tile_code = display.vram[TILE_MAP_0 - MEM_VIDEO + (tile_y * 32) + tile_x];
-		} else {
-			// tile map is at 0x9C00-0x9FFF bank 0
-			tile_code = display.vram[TILE_MAP_1 - MEM_VIDEO + (tile_y * 32) + tile_x];
+/* the bytes of frame in use: its palettes are only filled up to pal_count */
+size_t display_frame_size(const Frame *frame) {
+	return offsetof(Frame, pals) + (frame->pal_count * sizeof(frame->pals[0]));
+}
+
+/* a surface a frame can be resolved into */
+SDL_Surface *display_create_surface(void) {
+	SDL_Surface *surface = SDL_CreateRGBSurface(SDL_SWSURFACE, DISPLAY_W, DISPLAY_H,
+			display.bpp, display.format.Rmask, display.format.Gmask, display.format.Bmask, 0);
+	if (surface == NULL) {
+		fprintf(stderr, "could not create surface\n");
+		exit(1);
+	}
+	return surface;
+}
+
+/* blanks every line of frame, at the start of a frame or when the lcd is
+ * switched on or off */
+static void frame_clear(Frame *frame) {
+	memset(frame->line_pals, LINE_BLANK, sizeof(frame->line_pals));
+	frame->pal_count = 0;
+}
+
+/* notes that lines first to end - 1 are drawn with the 16 palettes pals,
+ * adding them to the frame if they have changed since the last lines */
+static void frame_palettes(unsigned int first, unsigned int end, const Palette *pals) {
+	Frame *f = display.frame;
+	if ((f->pal_count == 0) || memcmp(f->pals[f->pal_count - 1], pals, sizeof(display.palettes))) {
+		/* at most one set per line, unless lines are drawn again */
+		if (f->pal_count == DISPLAY_H)
+			f->pal_count--;
+		memcpy(f->pals[f->pal_count], pals, sizeof(display.palettes));
+		f->pal_count++;
+	}
+	memset(&f->line_pals[first], f->pal_count - 1, end - first);
+}
+
+/* for a ppu which draws straight into the frame: line ly has been drawn
+ * with the 16 palettes pals */
+void display_line_palettes(const unsigned int ly, const Palette *pals) {
+	frame_palettes(ly, ly + 1, pals);
+}
+
+/* the line ppu draws the line, or leaves it for later */
+static void line_end(const Byte lcdc, const Byte ly) {
+	log_line(lcdc, ly);
+	if (!display.is_deferred)
+		display_flush();
+}
+
+/* draws every line again from the registers as they are now, for the
+ * benchmark */
+static void line_frame(void) {
+	const Byte lcdc = read_io(HWREG_LCDC);
+	unsigned int ly;
+	for (ly = 0; ly < DISPLAY_H; ly++)
+		log_line(lcdc, ly);
+	draw_lines(0, DISPLAY_H);
+	display.log_start = display.log_end = 0;
+}
+
+static void palette_changed(const unsigned int n) {
+	if (ppus[display.ppu].palette != NULL)
+		ppus[display.ppu].palette(n);
+}
+
+/* records the registers line ly is drawn with, as they are when the lcd
+ * has finished reading it */
+static void log_line(const Byte lcdc, const Byte ly) {
+	LineRegs *regs = &line_log[ly];
+	regs->lcdc = lcdc;
+	regs->scx = read_io(HWREG_SCX);
+	regs->scy = read_io(HWREG_SCY);
+	regs->wx = read_io(HWREG_WX);
+	regs->wy = read_io(HWREG_WY);
+	if (display.log_start == display.log_end)
+		display.log_start = ly;
+	display.log_end = ly + 1;
+}
+
+/* draws the logged lines which have not been drawn yet. the scan line
+ * renderer calls this for every line. the frame renderer leaves it until
+ * vblank, or until vram, oam or a palette is about to change, since the
+ * logged lines must be drawn with them as they were. */
+void display_flush(void) {
+	uint64_t start;
+	if (display.log_start == display.log_end)
+		return;
+	start = stats_now();
+	draw_lines(display.log_start, display.log_end);
+	counter_add(&render_counter, display.log_end - display.log_start);
+	render_counter.time += stats_now() - start;
+	display.log_start = display.log_end = 0;
+}
+
+/* draws lines first to end - 1 from the line log. lines only depend on
+ * their log entry, vram, oam and the palettes, none of which change while
+ * they are drawn, so a big enough batch is shared between the raster
+ * threads. */
+static void draw_lines(unsigned int first, unsigned int end) {
+	unsigned int i, count, ly;
+	if (display.is_sprite_index_dirty)
+		sprite_index_build();
+	frame_palettes(first, end, display.palettes);
+	if ((raster_threads == 1) || (end - first < MIN_PARALLEL_LINES)) {
+		for (ly = first; ly < end; ly++)
+			draw_line(display.frame->codes[ly], ly);
+		return;
+	}
+	/* give each worker an equal run of lines to start with */
+	count = end - first;
+	for (i = 0; i < raster_threads; i++) {
+		workers[i].range = (first + (count * i) / raster_threads)
+			| ((first + (count * (i + 1)) / raster_threads) << 16);
+	}
+	__sync_synchronize();
+	for (i = 1; i < raster_threads; i++)
+		SDL_SemPost(workers[i].start_sem);
+	raster_work(&workers[0]);
+	for (i = 1; i < raster_threads; i++)
+		SDL_SemWait(raster_done_sem);
+}
+
+/* draws lines until there are none left to take or steal */
+static void raster_work(RasterWorker *w) {
+	int ly;
+	while (((ly = take_line(w)) >= 0) || ((ly = steal_lines(w)) >= 0))
+		draw_line(display.frame->codes[ly], ly);
+}
+
+/* takes the next line of the worker's own run, or returns -1 */
+static int take_line(RasterWorker *w) {
+	uint32_t range, next;
+	do {
+		range = w->range;
+		next = range & 0xffff;
+		if (next >= (range >> 16))
+			return -1;
+	} while (!__sync_bool_compare_and_swap(&w->range, range, range + 1));
+	return next;
+}
+
+/* takes the top half of the longest run left, keeping the rest of it
+ * for this worker. returns its first line, or -1 if nothing is left */
+static int steal_lines(RasterWorker *w) {
+	RasterWorker *victim;
+	uint32_t range, next, end, mid, left, most;
+	unsigned int i;
+	while (1) {
+		victim = NULL;
+		most = 0;
+		for (i = 0; i < raster_threads; i++) {
+			range = workers[i].range;
+			left = (range >> 16) - (range & 0xffff);
+			if (((range >> 16) > (range & 0xffff)) && (left > most)) {
+				most = left;
+				victim = &workers[i];
+			}
 		}
-		if ((lcdc & 0x10) == 0) {
-			// tile data is at 0x8800-0x97FF (indeces signed)
-			// complement upper bit
-			tile_code ^= 0x80;
-			tile_blit(&display.tiles_tdt_1[tile_code], x_pos, offset_y, NO_FLIP, 0, PRIORITY_LOW);
-		} else {
-			// tile data is at 0x8000-0x8FFF (indeces unsigned)
-			tile_blit(&display.tiles_tdt_0[tile_code], x_pos, offset_y, NO_FLIP, 0, PRIORITY_LOW);
+		if (victim == NULL)
+			return -1;
+		range = victim->range;
+		next = range & 0xffff;
+		end = range >> 16;
+		if (next >= end)
+			continue;
+		mid = next + (end - next) / 2;
+		if (__sync_bool_compare_and_swap(&victim->range, range, next | (mid << 16))) {
+			w->range = (mid + 1) | (end << 16);
+			return mid;
 		}
 	}
 }
 
-static void draw_gbc_background(const Byte lcdc, const Byte ly) {
- 	unsigned int x;
-	Byte scx = read_io(HWREG_SCX);
-	Byte scy = read_io(HWREG_SCY);
-	Byte wx = read_io(HWREG_WX);
-	Byte wy = read_io(HWREG_WY);
-	unsigned int tile_code;
-	Byte offset_x = scx & 0x07;
-	Byte offset_y = (ly + scy) & 0x07;
-	Byte bg_y = (ly + scy) & 0xFF;
-	Byte tile_x;
-	Byte tile_y;
-	Byte attrib;
-	int screen_x;
-	unsigned int x_pos;
-	for (x = scx; x <= (scx + (unsigned)DISPLAY_W); x += 8) {
-		Byte bg_x = x & 0xFF;
-		tile_x = (bg_x / 8);
-		tile_y = (bg_y / 8);
-		screen_x = scx / 8;
-		x_pos = x - scx - offset_x;
-		/* dont draw over the window! */
-		if ((lcdc & 0x20) && (x_pos + 7 >= wx) && (ly >= wy))
-			continue;
-		if ((lcdc & 0x08) == 0) {
-			// tile map is at 0x9800-0x9BFF bank 0
-			tile_code = display.vram[TILE_MAP_0 - MEM_VIDEO + (tile_y * 32) + tile_x];
-			attrib = display.vram[TILE_MAP_0 - MEM_VIDEO + VRAM_BANK_SIZE + (tile_y * 32) + tile_x];
-		} else {
-			// tile map is at 0x9C00-0x9FFF bank 0
-			tile_code = display.vram[TILE_MAP_1 - MEM_VIDEO + (tile_y * 32) + tile_x];
-			attrib = display.vram[TILE_MAP_1 - MEM_VIDEO + VRAM_BANK_SIZE + (tile_y * 32) + tile_x];
+static int raster_loop(void *data) {
+	RasterWorker *w = data;
+	while (1) {
+		SDL_SemWait(w->start_sem);
+		if (is_raster_quit)
+			break;
+		raster_work(w);
+		SDL_SemPost(raster_done_sem);
+	}
+	return 0;
+}
+
+/* sets the number of threads lines are drawn on, including this one */
+void display_set_raster_threads(unsigned int count) {
+	unsigned int i;
+	if (count < 1)
+		count = 1;
+	if (count > MAX_RASTER_THREADS)
+		count = MAX_RASTER_THREADS;
+	display_flush();
+	for (i = raster_threads_started; i < count; i++) {
+		workers[i].start_sem = SDL_CreateSemaphore(0);
+		workers[i].thread = SDL_CreateThread(raster_loop, &workers[i]);
+		if (workers[i].thread == NULL) {
+			fprintf(stderr, "could not create raster thread: %s\n", SDL_GetError());
+			exit(1);
 		}
-		if ((lcdc & 0x10) == 0) {
-			// tile data is at 0x8800-0x97FF (indeces signed)
-			// complement upper bit
-			tile_code ^= 0x80;
-			if (attrib & TILE_VRAM_BANK)
-				tile_code += 256;
-			tile_blit(&display.tiles_tdt_1[tile_code], x_pos, offset_y, (attrib >> 5) & 0x03, attrib & 0x07, PRIORITY_LOW);
+	}
+	if (count > raster_threads_started)
+		raster_threads_started = count;
+	raster_threads = count;
+}
 
-		} else {
-			if (attrib & TILE_VRAM_BANK)
-				tile_code += 256;
-			tile_blit(&display.tiles_tdt_0[tile_code], x_pos, offset_y, (attrib >> 5) & 0x03, attrib & 0x07, PRIORITY_LOW);
+unsigned int display_get_raster_threads(void) {
+	return raster_threads;
+}
+
+/* draws the last frame's logged lines again with 1, 2, 4 and 8 raster
+ * threads, and prints each time against a single thread. then times a
+ * frame from each ppu against the line ppu on one thread, then the
+ * background and window alone, from the row cache and with every row
+ * decoded again, and the sprites alone over the frame's finished lines.
+ * all of these draw into the frame being drawn, and the ppus log lines
+ * from the registers as they are now, so both are put back afterwards */
+void display_benchmark(void) {
+	static const unsigned int counts[] = {1, 2, 4, 8};
+	unsigned int saved = raster_threads;
+	unsigned int i, j, ly;
+	uint64_t start, time, single = 0;
+	Byte scan_line[DISPLAY_W];
+	Frame *frame;
+	LineRegs *log;
+	display_flush();
+	frame = malloc(sizeof(Frame));
+	log = malloc(sizeof(line_log));
+	if ((frame == NULL) || (log == NULL)) {
+		fprintf(stderr, "could not allocate benchmark frame\n");
+		exit(1);
+	}
+	memcpy(frame, display.frame, sizeof(Frame));
+	memcpy(log, line_log, sizeof(line_log));
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		display_set_raster_threads(counts[i]);
+		start = stats_now();
+		for (j = 0; j < BENCHMARK_FRAMES; j++)
+			draw_lines(0, DISPLAY_H);
+		time = (stats_now() - start) / BENCHMARK_FRAMES;
+		if (i == 0)
+			single = time;
+		printf("raster benchmark: %u thread(s): %.1fus per frame, %.2fx\n",
+				counts[i], time / 1000.0, (double)single / time);
+	}
+	display_set_raster_threads(1);
+	for (i = 0; i < PPUS; i++) {
+		start = stats_now();
+		for (j = 0; j < BENCHMARK_FRAMES; j++)
+			ppus[i].frame();
+		time = (stats_now() - start) / BENCHMARK_FRAMES;
+		if (i == 0)
+			single = time;
+		printf("ppu benchmark: %s: %.1fus per frame, %.2fx the line ppu\n",
+				ppus[i].name, time / 1000.0, (double)time / single);
+	}
+	memcpy(line_log, log, sizeof(line_log));
+	display_set_raster_threads(saved);
+	for (i = 0; i < 2; i++) {
+		start = stats_now();
+		for (j = 0; j < BENCHMARK_FRAMES; j++) {
+			if (i == 1)
+				bg_rows_dirty();
+			for (ly = 0; ly < DISPLAY_H; ly++) {
+				draw_background(scan_line, &line_log[ly], ly);
+				if (line_log[ly].lcdc & 0x20)
+					draw_window(scan_line, &line_log[ly], ly);
+			}
+		}
+		printf("bg benchmark: %s rows: %.1fus per frame\n", i ? "decoded" : "cached",
+				(stats_now() - start) / BENCHMARK_FRAMES / 1000.0);
+	}
+	if (display.is_sprite_index_dirty)
+		sprite_index_build();
+	start = stats_now();
+	for (j = 0; j < BENCHMARK_FRAMES; j++) {
+		for (ly = 0; ly < DISPLAY_H; ly++) {
+			if (!(line_log[ly].lcdc & 0x02))
+				continue;
+			memcpy(scan_line, display.frame->codes[ly], DISPLAY_W);
+			if (console_mode == MODE_GBC_ENABLED)
+				draw_gbc_sprites(scan_line, &line_log[ly], ly);
+			else
+				draw_sprites(scan_line, &line_log[ly], ly);
 		}
 	}
+	printf("sprite benchmark: %.1fus per frame\n",
+			(stats_now() - start) / BENCHMARK_FRAMES / 1000.0);
+	memcpy(display.frame, frame, sizeof(Frame));
+	free(frame);
+	free(log);
+}
+
+/* switches between drawing each line as the lcd finishes it and drawing
+ * the whole frame at vblank */
+void display_set_deferred(int is_deferred) {
+	display_flush();
+	display.is_deferred = is_deferred;
 }
 
-static void draw_window(const Byte lcdc, const Byte ly) {
-    unsigned int win_x;
-	Byte wx = read_io(HWREG_WX);
-    Byte wy = read_io(HWREG_WY);
-	unsigned int tile_code;
-	Byte offset_y = (ly - wy) & 0x07;
-	Byte win_y = (ly - wy);
-	Byte tile_x;
-	Byte tile_y;
-	int x;
-	if ((win_y >= DISPLAY_H) || (ly < wy))
+static void draw_line(Byte *scan_line, const Byte ly) {
+	const LineRegs *regs = &line_log[ly];
+	if (console_mode == MODE_GBC_ENABLED) {
+		if (regs->lcdc & 0x01)
+			draw_background(scan_line, regs, ly);
+		else
+			clear_scan_line(scan_line);
+		if (regs->lcdc & 0x20)
+			draw_window(scan_line, regs, ly);
+		if (regs->lcdc & 0x02)
+			draw_gbc_sprites(scan_line, regs, ly);
+	} else {
+		if (regs->lcdc & 0x01)
+			draw_background(scan_line, regs, ly);
+		else
+			clear_scan_line(scan_line);
+		if (regs->lcdc & 0x20)
+			draw_window(scan_line, regs, ly);
+		if (regs->lcdc & 0x02)
+			draw_sprites(scan_line, regs, ly);
+	}
+}
+
+static void clear_scan_line(Byte *scan_line) {
+	memset(scan_line, 0x00, DISPLAY_W);
+}
+
+/* called when the lcd has finished a frame. without the render thread, the
+ * frame is presented straight away. with it, the frame is handed over and
+ * drawing carries on in another buffer while it is presented. */
+void draw_frame() {
+	uint64_t start = stats_now();
+	int old;
+	capture_frame(display.frame, core.clock);
+	tileview_frame();
+	if (render_thread == NULL) {
+		display_lock_video();
+		video_present(display.frame);
+		display_unlock_video();
+		counter_stop(&latency_counter, start);
+	} else {
+		frame_time[draw_index] = start;
+		/* the frame must be complete before the render thread can see it */
+		__sync_synchronize();
+		old = __sync_lock_test_and_set(&ready_index, draw_index | FRAME_NEW);
+		if (old & FRAME_NEW)
+			counter_inc(&drop_counter);
+		draw_index = old & FRAME_INDEX;
+		display.frame = frames[draw_index];
+		SDL_SemPost(frame_sem);
+	}
+	counter_stop(&handoff_counter, start);
+}
+
+/* presents the frames handed over by draw_frame(), until told to quit */
+static int render_loop(void *data) {
+	int old;
+	while (1) {
+		SDL_SemWait(frame_sem);
+		if (is_render_quit)
+			break;
+		/* the semaphore is posted once per frame, but only the newest
+		 * frame is presented */
+		if (!(ready_index & FRAME_NEW))
+			continue;
+		old = __sync_lock_test_and_set(&ready_index, present_index);
+		present_index = old & FRAME_INDEX;
+		__sync_synchronize();
+		display_lock_video();
+		video_present(frames[present_index]);
+		display_unlock_video();
+		latency_counter.time += stats_now() - frame_time[present_index];
+		counter_inc(&latency_counter);
+	}
+	return 0;
+}
+
+/* starts or stops presenting frames on the render thread */
+void display_set_threaded(int is_threaded) {
+	int i;
+	if (is_threaded == (render_thread != NULL))
 		return;
-	for (win_x = 0; win_x <= 255; win_x += 8) {
-		tile_x = (win_x / 8);
-		tile_y = (win_y / 8);
-		x = win_x + wx - (signed)7;
-		if (x >= DISPLAY_W)
-			return;
-        if ((lcdc & 0x40) == 0) {
-            // tile map is at 0x9800-0x9BFF
-			tile_code = display.vram[TILE_MAP_0 - MEM_VIDEO + (tile_y * 32) + tile_x];
-        } else {
-            // tile map is at 0x9C00-0x9FFF
-			tile_code = display.vram[TILE_MAP_1 - MEM_VIDEO + (tile_y * 32) + tile_x];
-        }
-        if ((lcdc & 0x10) == 0) {
-		    // tile data is at 0x8800-0x97FF (indeces signed)
-			// complement upper bit
-			tile_code ^= 0x80;
-			tile_blit(&display.tiles_tdt_1[tile_code], x, offset_y, NO_FLIP, 0, PRIORITY_LOW);
-	    } else {
-		    // tile data is at 0x8000-0x8FFF (indeces unsigned)
-			tile_blit(&display.tiles_tdt_0[tile_code], x, offset_y, NO_FLIP, 0, PRIORITY_LOW);
+	if (is_threaded) {
+		for (i = 0; i < FRAME_COUNT; i++) {
+			if (frames[i] != NULL)
+				continue;
+			frames[i] = malloc(sizeof(Frame));
+			frame_clear(frames[i]);
 		}
+		/* display.frame is always frames[draw_index] */
+		ready_index = (draw_index + 1) % FRAME_COUNT;
+		present_index = (draw_index + 2) % FRAME_COUNT;
+		is_render_quit = 0;
+		render_thread = SDL_CreateThread(render_loop, NULL);
+		if (render_thread == NULL) {
+			fprintf(stderr, "could not create render thread: %s\n", SDL_GetError());
+			exit(1);
+		}
+	} else {
+		is_render_quit = 1;
+		SDL_SemPost(frame_sem);
+		SDL_WaitThread(render_thread, NULL);
+		render_thread = NULL;
 	}
 }
 
-static void draw_gbc_window(const Byte lcdc, const Byte ly) {
-    unsigned int win_x;
-	Byte wx = read_io(HWREG_WX);
-    Byte wy = read_io(HWREG_WY);
-	unsigned int tile_code;
-	Byte offset_y = (ly - wy) & 0x07;
-	Byte win_y = (ly - wy);
-	Byte tile_x;
-	Byte tile_y;
-	Byte attrib;
-	int x;
-	if ((win_y >= DISPLAY_H) || (ly < wy))
+int display_is_threaded(void) {
+	return render_thread != NULL;
+}
+
+/* the sdl video and event functions may only be used by one thread at a
+ * time: the render thread holds this lock while presenting */
+void display_lock_video(void) {
+	SDL_SemWait(video_sem);
+}
+
+/* returns 1 and takes the lock if it is free, otherwise 0 */
+int display_try_lock_video(void) {
+	return SDL_SemTryWait(video_sem) == 0;
+}
+
+void display_unlock_video(void) {
+	SDL_SemPost(video_sem);
+}
+
+/* the background is a wrapping copy of its row from the row cache */
+static void draw_background(Byte *scan_line, const LineRegs *regs, const Byte ly) {
+	Byte bg_y = ly + regs->scy;
+	const Byte *row = get_bg_row((regs->lcdc >> 3) & 0x01, regs->lcdc, bg_y);
+	unsigned int n = BG_W - regs->scx;
+	if (n >= DISPLAY_W) {
+		memcpy(scan_line, row + regs->scx, DISPLAY_W);
+	} else {
+		memcpy(scan_line, row + regs->scx, n);
+		memcpy(scan_line + n, row, DISPLAY_W - n);
+	}
+}
+
+/* the window is its row from the row cache, from wx - 7 to the right edge */
+static void draw_window(Byte *scan_line, const LineRegs *regs, const Byte ly) {
+	int x = regs->wx - 7;
+	int src = 0;
+	int n;
+	const Byte *row;
+	if (ly < regs->wy || x >= DISPLAY_W)
 		return;
-	for (win_x = 0; win_x <= 255; win_x += 8) {
-		tile_x = (win_x / 8);
-		tile_y = (win_y / 8);
-		x = win_x + wx - (signed)7;
-		if (x >= DISPLAY_W)
-			return;
-        if ((lcdc & 0x40) == 0) {
-            // tile map is at 0x9800-0x9BFF
-			tile_code = display.vram[TILE_MAP_0 - MEM_VIDEO + (tile_y * 32) + tile_x];
-			attrib = display.vram[TILE_MAP_0 - MEM_VIDEO + VRAM_BANK_SIZE + (tile_y * 32) + tile_x];
-        } else {
-            // tile map is at 0x9C00-0x9FFF
-			tile_code = display.vram[TILE_MAP_1 - MEM_VIDEO + (tile_y * 32) + tile_x];
-			attrib = display.vram[TILE_MAP_1 - MEM_VIDEO + VRAM_BANK_SIZE + (tile_y * 32) + tile_x];
-        }
-        if ((lcdc & 0x10) == 0) {
-		    // tile data is at 0x8800-0x97FF (indeces signed)
+	row = get_bg_row((regs->lcdc >> 6) & 0x01, regs->lcdc, ly - regs->wy);
+	if (x < 0) {
+		src = -x;
+		x = 0;
+	}
+	n = DISPLAY_W - x;
+	if (n > BG_W - src)
+		n = BG_W - src;
+	memcpy(scan_line + x, row + src, n);
+}
+
+/* returns row y of tile map 'map' (0 at 0x9800, 1 at 0x9C00) drawn with
+ * the tile data lcdc selects. a row is kept until its tile map row, or a
+ * tile it uses, is written. */
+static const Byte *get_bg_row(const int map, const Byte lcdc, const Byte y) {
+	BgRow *row = &bg_rows[map][y];
+	unsigned int tag = (display.map_row_version[map][y / 8] << 1) | ((lcdc >> 4) & 0x01);
+	counter_inc(&row_lookup_counter);
+	if (__atomic_load_n(&row->tag, __ATOMIC_ACQUIRE) == tag) {
+		counter_inc(&row_hit_counter);
+		return row->px;
+	}
+	bg_row_build(row->px, map, lcdc, y);
+	__atomic_store_n(&row->tag, tag, __ATOMIC_RELEASE);
+	return row->px;
+}
+
+/* decodes all 32 tiles of a row, noting in each tile that the row uses it */
+static void bg_row_build(Byte *px, const int map, const Byte lcdc, const Byte y) {
+	const Byte *codes = display.vram + (map ? TILE_MAP_1 : TILE_MAP_0) - MEM_VIDEO + (y / 8) * 32;
+	const uint64_t user = (uint64_t)1 << ((map * 32) + (y / 8));
+	unsigned int tile_x, tile_code;
+	Byte attrib = 0;
+	uint64_t row;
+	int flip;
+	Tile *t;
+	for (tile_x = 0; tile_x < 32; tile_x++) {
+		tile_code = codes[tile_x];
+		if (console_mode == MODE_GBC_ENABLED)
+			attrib = codes[VRAM_BANK_SIZE + tile_x];
+		if (attrib & TILE_VRAM_BANK)
+			tile_code += 256;
+		if ((lcdc & 0x10) == 0) {
+			// tile data is at 0x8800-0x97FF (indeces signed)
 			// complement upper bit
-			tile_code ^= 0x80;
-       		if (attrib & TILE_VRAM_BANK)
-				tile_code += 256;
-			tile_blit(&display.tiles_tdt_1[tile_code], x, offset_y, NO_FLIP, attrib & 0x07, PRIORITY_LOW);
+			t = &display.tiles_tdt_1[tile_code ^ 0x80];
 		} else {
 			// tile data is at 0x8000-0x8FFF (indeces unsigned)
-			if (attrib & TILE_VRAM_BANK)
-				tile_code += 256;
-			tile_blit(&display.tiles_tdt_0[tile_code], x, offset_y, NO_FLIP, attrib & 0x07, PRIORITY_LOW);
+			t = &display.tiles_tdt_0[tile_code];
 		}
+		if (!(t->row_users & user))
+			__sync_fetch_and_or(&t->row_users, user);
+		flip = (attrib >> 5) & 0x03;
+		if (!(__atomic_load_n(&t->cached_flips, __ATOMIC_ACQUIRE) & (1 << flip)))
+			tile_regenerate(t, flip);
+		/* the tile's row of codes is written as one word, with the
+		 * palette number in every byte */
+		memcpy(&row, t->cache_px[flip] + (y & 0x07) * 8, sizeof(row));
+		row |= (uint64_t)((attrib & TILE_PALETTE) << 2) * 0x0101010101010101ULL;
+		memcpy(px + tile_x * 8, &row, sizeof(row));
 	}
+	counter_inc(&row_decode_counter);
 }
 
-/* TODO optimise? */
-static void draw_sprites(const Byte lcdc, const Byte ly) {
-	int sprite_x;
-	int sprite_y;
-	int offset_y;
+/* a tile has changed: the rows which use it must be decoded again */
+void tile_rows_dirty(Tile *t) {
+	uint64_t users = t->row_users;
 	int i;
-	Byte priority;
-	for (i = OAM_BLOCKS - 1; i >= 0; i--) {
-		sprite_y = get_sprite_y(i) - (signed)16;
-		sprite_x = get_sprite_x(i) - (signed)8;
-		priority = get_sprite_flags(i) >> 7;
-		if ((ly >= sprite_y) && (ly < (sprite_y + display.sprite_height))) {
-			offset_y = (signed)ly - sprite_y;
-			sprite_blit(&display.tiles_tdt_0[get_sprite_pattern(i)], sprite_x, offset_y, (get_sprite_flags(i) & 0x60) >> 5, (get_sprite_flags(i) >> 4) & 0x01, priority, display.sprite_height);
-		}
+	t->row_users = 0;
+	for (i = 0; i < 64; i++) {
+		if (users & ((uint64_t)1 << i))
+			++display.map_row_version[i / 32][i % 32];
+	}
+}
+
+/* drops every cached row, for when vram is replaced wholesale */
+static void bg_rows_dirty(void) {
+	int i, j;
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 32; j++)
+			++display.map_row_version[i][j];
+	}
+}
+
+/* sprites are drawn lowest priority first, so the highest ends up on top */
+static void draw_sprites(Byte *scan_line, const LineRegs *regs, const Byte ly) {
+	const SpriteLine *line = &sprite_index[ly];
+	const Byte *oam;
+	int i;
+	for (i = line->count - 1; i >= 0; i--) {
+		oam = display.oam + (OAM_BLOCK_SIZE * line->sprites[i]);
+		sprite_blit(scan_line, &display.tiles_tdt_0[get_sprite_pattern(line->sprites[i])],
+				oam[OAM_XPOS] - 8, ly - (oam[OAM_YPOS] - 16),
+				(oam[OAM_FLAGS] & 0x60) >> 5, (oam[OAM_FLAGS] >> 4) & 0x01,
+				oam[OAM_FLAGS] >> 7, display.sprite_height);
 	}
 }
 
-static void draw_gbc_sprites(const Byte lcdc, const Byte ly) {
-	int sprite_x;
-	int sprite_y;
-	int offset_y;
+static void draw_gbc_sprites(Byte *scan_line, const LineRegs *regs, const Byte ly) {
+	const SpriteLine *line = &sprite_index[ly];
+	const Byte *oam;
 	int i;
-	Byte priority;
 	int tile_code;
-	for (i = OAM_BLOCKS - 1; i >= 0; i--) {
-		sprite_y = get_sprite_y(i) - (signed)16;
-		sprite_x = get_sprite_x(i) - (signed)8;
-		priority = get_sprite_flags(i) >> 7;
-		if ((ly >= sprite_y) && (ly < (sprite_y + display.sprite_height))) {
-			offset_y = (signed)ly - sprite_y;
-			tile_code = get_sprite_pattern(i);
-			if (get_sprite_flags(i) & 0x08)
-				tile_code += 256;
-			sprite_blit(&display.tiles_tdt_0[tile_code], sprite_x, offset_y, (get_sprite_flags(i) & 0x60) >> 5, get_sprite_flags(i) & 0x07, priority, display.sprite_height);
-		}
+	for (i = line->count - 1; i >= 0; i--) {
+		oam = display.oam + (OAM_BLOCK_SIZE * line->sprites[i]);
+		tile_code = get_sprite_pattern(line->sprites[i]);
+		if (oam[OAM_FLAGS] & 0x08)
+			tile_code += 256;
+		sprite_blit(scan_line, &display.tiles_tdt_0[tile_code],
+				oam[OAM_XPOS] - 8, ly - (oam[OAM_YPOS] - 16),
+				(oam[OAM_FLAGS] & 0x60) >> 5, oam[OAM_FLAGS] & 0x07,
+				oam[OAM_FLAGS] >> 7, display.sprite_height);
 	}
 }
 
+/* the lcd takes the first MAX_SPRITES_PER_LINE sprites in oam order which
+ * cover a line. on the gbc the earlier one of two overlapping sprites is
+ * drawn on top; on the dmg it is the one further left, then the earlier. */
+static void sprite_index_build(void) {
+	int i, j, ly, y, end;
+	Byte sprite;
+	SpriteLine *line;
+	for (ly = 0; ly < DISPLAY_H; ly++)
+		sprite_index[ly].count = 0;
+	for (i = 0; i < OAM_BLOCKS; i++) {
+		y = get_sprite_y(i) - 16;
+		end = y + display.sprite_height;
+		if (end > DISPLAY_H)
+			end = DISPLAY_H;
+		for (ly = (y < 0) ? 0 : y; ly < end; ly++) {
+			line = &sprite_index[ly];
+			if (line->count < MAX_SPRITES_PER_LINE)
+				line->sprites[line->count++] = i;
+		}
+	}
+	if (console_mode != MODE_GBC_ENABLED) {
+		/* a stable insertion sort on x keeps oam order between equals */
+		for (ly = 0; ly < DISPLAY_H; ly++) {
+			line = &sprite_index[ly];
+			for (i = 1; i < line->count; i++) {
+				sprite = line->sprites[i];
+				for (j = i; (j > 0) && (get_sprite_x(line->sprites[j - 1]) > get_sprite_x(sprite)); j--)
+					line->sprites[j] = line->sprites[j - 1];
+				line->sprites[j] = sprite;
+			}
+		}
+	}
+	display.is_sprite_index_dirty = 0;
+	counter_inc(&sprite_index_counter);
+}
 
 void update_bg_palette(unsigned n, Byte p) {
+	display_flush();
 	display.bg_pal[n].colour[0] = display.mono_colours[p & 0x03];
 	display.bg_pal[n].colour[1] = display.mono_colours[(p >> 2) & 0x03];
 	display.bg_pal[n].colour[2] = display.mono_colours[(p >> 4) & 0x03];
 	display.bg_pal[n].colour[3] = display.mono_colours[(p >> 6) & 0x03];
+	palette_changed(n);
 }
 
 void update_sprite_palette(unsigned n, Byte p) {
+	display_flush();
 	// colour 0 is transparent anyway.
 	display.spr_pal[n].colour[0] = display.mono_colours[p & 0x03];
 	display.spr_pal[n].colour[1] = display.mono_colours[(p >> 2) & 0x03];
 	display.spr_pal[n].colour[2] = display.mono_colours[(p >> 4) & 0x03];
 	display.spr_pal[n].colour[3] = display.mono_colours[(p >> 6) & 0x03];
+	palette_changed(8 + n);
 }
 
 void update_gbc_bg_palette(Byte value) {
 	Byte bgpi, index;
-	int pal, col, byte1, byte2;
-	Byte r, g, b;
+	int pal, col;
+	display_ppu_sync();
+	display_flush();
 	
 	bgpi = read_io(HWREG_BGPI);
 	index = bgpi & 0x3f;
@@ -645,12 +1233,8 @@ void update_gbc_bg_palette(Byte value) {
 
 	display.gbc_bg_pal_mem[index] = value;
 
-	byte1 = display.gbc_bg_pal_mem[(pal * 8) + col * 2];
-	byte2 = display.gbc_bg_pal_mem[(pal * 8) + (col * 2) + 1];
-	r = byte1 & 0x1f;
-	g = ((byte1 >> 5) & 0x07) | ((byte2 & 0x03) << 3);
-	b = (byte2 >> 2) & 0x1f;
-	display.bg_pal[pal].colour[col] = translate_gbc_rgb(r, g, b);
+	display.bg_pal[pal].colour[col] = gbc_colour(display.gbc_bg_pal_mem + (pal * 8) + (col * 2));
+	palette_changed(pal);
 	
 	/* autoincrement? */
 	if (bgpi & 0x80)
@@ -659,8 +1243,9 @@ void update_gbc_bg_palette(Byte value) {
 
 void update_gbc_spr_palette(Byte value) {
 	Byte obpi, index;
-	int pal, col, byte1, byte2;
-	Byte r, g, b;
+	int pal, col;
+	display_ppu_sync();
+	display_flush();
 	
 	obpi = read_io(HWREG_OBPI);
 	index = obpi & 0x3f;
@@ -669,21 +1254,108 @@ void update_gbc_spr_palette(Byte value) {
 
 	display.gbc_spr_pal_mem[index] = value;
 
-	byte1 = display.gbc_spr_pal_mem[(pal * 8) + col * 2];
-	byte2 = display.gbc_spr_pal_mem[(pal * 8) + (col * 2) + 1];
-	r = byte1 & 0x1f;
-	g = ((byte1 >> 5) & 0x07) | ((byte2 & 0x03) << 3);
-	b = (byte2 >> 2) & 0x1f;
-	display.spr_pal[pal].colour[col] = translate_gbc_rgb(r, g, b);
+	display.spr_pal[pal].colour[col] = gbc_colour(display.gbc_spr_pal_mem + (pal * 8) + (col * 2));
+	palette_changed(8 + pal);
 	
 	/* autoincrement? */
 	if (obpi & 0x80)
 		write_io(HWREG_OBPI, ((index + 1) & 0x3f) | 0x80);
 }
 
-static Colour translate_gbc_rgb(uint8_t r, uint8_t g, uint8_t b) {
-	/* FIXME this simple translation produces far too vibrant colours */
-	return map_rgb(r * 8, g * 8, b * 8);
+/* the host pixel for the little endian rgb555 colour at p in palette memory */
+static inline Colour gbc_colour(const Byte *p) {
+	return gbc_colours[(p[0] | (p[1] << 8)) & 0x7fff];
+}
+
+/* builds gbc_colours, unless it is already built for the current colour
+ * profile and pixel format */
+static void gbc_colours_update(void) {
+	const ColourProfile *p = &colour_profiles[colour_profile];
+	const SDL_PixelFormat *f = &display.format;
+	double lcd[32], out[3];
+	Byte rgb[3];
+	int i, k;
+	if ((gbc_colours_profile == colour_profile) && (gbc_colours_masks[0] == f->Rmask)
+			&& (gbc_colours_masks[1] == f->Gmask) && (gbc_colours_masks[2] == f->Bmask))
+		return;
+	for (i = 0; i < 32; i++)
+		lcd[i] = pow(i / 31.0, p->gamma);
+	for (i = 0; i < (1 << 15); i++) {
+		rgb[0] = i & 0x1f;
+		rgb[1] = (i >> 5) & 0x1f;
+		rgb[2] = (i >> 10) & 0x1f;
+		if (p->matrix == NULL) {
+			gbc_colours[i] = SDL_MapRGB(&display.format, rgb[0] * 8, rgb[1] * 8, rgb[2] * 8);
+			continue;
+		}
+		for (k = 0; k < 3; k++) {
+			out[k] = p->lum * (p->matrix[k][0] * lcd[rgb[0]]
+					+ p->matrix[k][1] * lcd[rgb[1]] + p->matrix[k][2] * lcd[rgb[2]]);
+			out[k] = (out[k] < 0.0) ? 0.0 : (out[k] > 1.0) ? 1.0 : out[k];
+			out[k] = pow(out[k], 1.0 / HOST_GAMMA) * 255.0 + 0.5;
+		}
+		gbc_colours[i] = SDL_MapRGB(&display.format, out[0], out[1], out[2]);
+	}
+	gbc_colours_profile = colour_profile;
+	gbc_colours_masks[0] = f->Rmask;
+	gbc_colours_masks[1] = f->Gmask;
+	gbc_colours_masks[2] = f->Bmask;
+}
+
+/* translates all of palette memory again, after the colour profile changes */
+static void gbc_palettes_refresh(void) {
+	int pal, col;
+	for (pal = 0; pal < 8; pal++) {
+		for (col = 0; col < 4; col++) {
+			display.bg_pal[pal].colour[col] = gbc_colour(display.gbc_bg_pal_mem + (pal * 8) + (col * 2));
+			display.spr_pal[pal].colour[col] = gbc_colour(display.gbc_spr_pal_mem + (pal * 8) + (col * 2));
+		}
+	}
+}
+
+void display_set_colour_profile(unsigned int profile) {
+	display_flush();
+	colour_profile = profile % COLOUR_PROFILES;
+	gbc_colours_update();
+	if (console_mode == MODE_GBC_ENABLED)
+		gbc_palettes_refresh();
+}
+
+unsigned int display_get_colour_profile(void) {
+	return colour_profile;
+}
+
+const char *display_colour_profile_name(unsigned int profile) {
+	return colour_profiles[profile].name;
+}
+
+/* switches ppu between lines. a line already in mode 3 is finished by the
+ * new ppu from its start. */
+void display_set_ppu(unsigned int ppu) {
+	display_sync();
+	display_flush();
+	ppu %= PPUS;
+	if ((ppu != display.ppu) && (ppus[ppu].reset != NULL))
+		ppus[ppu].reset();
+	display.ppu = ppu;
+}
+
+unsigned int display_get_ppu(void) {
+	return display.ppu;
+}
+
+const char *display_ppu_name(unsigned int ppu) {
+	return ppus[ppu].name;
+}
+
+/* returns the ppu called name, or -1 */
+int display_find_ppu(const char *name) {
+	int i;
+	for (i = 0; i < PPUS; i++) {
+		if (strcmp(ppus[i].name, name) == 0)
+			return i;
+	}
+	return -1;
 }
 
 static inline Byte get_sprite_x(const unsigned int sprite) {
@@ -708,9 +1380,12 @@ static inline Byte get_sprite_flags(const unsigned int sprite) {
 void launch_dma(Byte address) {
 	unsigned int i;
 	Word real_address = address * 0x100;
+	display_ppu_sync();
+	display_flush();
 	for (i = 0; i < SIZE_OAM; i++) {
 		display.oam[i] = readb(real_address + i);
 	}
+	display.is_sprite_index_dirty = 1;
 }
 
 static void launch_hdma(int length) {
@@ -848,131 +1523,113 @@ static void fill_rectangle(SDL_Surface *surface, const int x, const int y,
 }
 
 static void tile_init(Tile *t, Byte* vram_px, Tile *next) {
-	int i;
 	t->vram_px = vram_px;
 	t->next = next;
-	for (i = 0; i < 4; i++) {
-		//t->is_dirty[i] = 1;
-		t->cache_px[i] = NULL;
-	}
+	t->cached_flips = 0;
+	t->version = 0;
+	t->row_users = 0;
 }
 
-static void tile_fini(Tile *t) {
-	int i;
-	for (i = 0; i < 4; i++) {
-		//t->is_dirty[i] = 1;
-		if (t->cache_px[i] != NULL) {
-			free(t->cache_px[i]);
-			t->cache_px[i] = NULL;
+/* the decoded colour codes of one flip of a tile, decoding it if needed */
+const Byte *display_tile_codes(Tile *t, const int flip) {
+	if (!(__atomic_load_n(&t->cached_flips, __ATOMIC_ACQUIRE) & (1 << flip)))
+		tile_regenerate(t, flip);
+	return t->cache_px[flip];
+}
+
+static void tile_lut_init(void) {
+	Byte px[8];
+	int b, x;
+	for (b = 0; b < 256; b++) {
+		reverse_lut[b] = 0;
+		for (x = 0; x < 8; x++) {
+			px[x] = (b >> (7 - x)) & 0x01;
+			reverse_lut[b] |= ((b >> x) & 0x01) << (7 - x);
 		}
+		/* byte x of the row is pixel x, whatever the host's endianness */
+		memcpy(&plane_lut[b], px, sizeof(px));
 	}
 }
 
+/* decodes one flip of a tile, a row at a time. a tile is decoded when it
+ * is first drawn after its data was written, so at most once per frame
+ * unless it is rewritten while the frame is being drawn. */
 static void tile_regenerate(Tile *t, const int flip) {
-	int x, y;
-	Byte colour;
-	Byte cache_x;
-	Byte cache_y;
-	//fill_rectangle(sprite->surface[flip], 0, 0, 8, sprite->height, 0);
-	assert(t->cache_px[flip] == NULL);
-	t->cache_px[flip] = malloc(8 * 8 * sizeof(Byte));
+	int y, vram_y;
+	Byte low, high;
+	uint64_t row;
+	uint64_t start = stats_now();
 	for (y = 0; y < 8; y++) {
-		for (x = 0; x < 8; x++) {
-			colour  = (t->vram_px[y * 2] & (0x80  >> x)) >> (7 - x);
-			colour |= (t->vram_px[(y * 2) + 1] & (0x80  >> x)) >> (7 - x) << 1;
-			cache_x = x;
-			cache_y = y;
-			if (flip & X_FLIP)
-				cache_x = 7 - cache_x;
-			if (flip & Y_FLIP)
-				cache_y = (8 - 1) - cache_y;
-		  //put_pixel(sprite->surface[flip], cache_x, cache_y, colour_code);
-			t->cache_px[flip][cache_y * 8 + cache_x] = colour;
+		vram_y = (flip & Y_FLIP) ? (7 - y) : y;
+		low = t->vram_px[vram_y * 2];
+		high = t->vram_px[(vram_y * 2) + 1];
+		if (flip & X_FLIP) {
+			low = reverse_lut[low];
+			high = reverse_lut[high];
 		}
+		row = plane_lut[low] | (plane_lut[high] << 1);
+		memcpy(&t->cache_px[flip][y * 8], &row, sizeof(row));
 	}
-	//sprite->is_invalidated[flip] = 0;
+	/* another raster thread may decode the same tile at the same time:
+	 * both write the same block, and it is published once it is written */
+	__sync_fetch_and_or(&t->cached_flips, 1 << flip);
+	counter_stop(&decode_counter, start);
 }
 
-static void tile_blit(Tile *t, const int x, const int line, const int flip, const int pal, const int priority) {
-	int i = 0;
-	Byte colour_code;
-	Byte data;
-	int w = 8;
-	if (x < 0) {
-		if (x < -7)
-			return;
-		i = -x;
-	} else if (x + w >= DISPLAY_W) {
-		if (x + w >= DISPLAY_W + 8)
-			return;
-		w = 8 - (x + w - DISPLAY_W);
-	}
-
-	if (t->cache_px[flip] == NULL)
-		tile_regenerate(t, flip);
-
-	data = 0 | (pal << 2) | (priority << 6);
-
-	for (; i < w; i++) {
-		colour_code = t->cache_px[flip][line * 8 + i];
-		//if ((line * 8 + i) > 63) {
-		//	fprintf(stderr, "%i, line = %i, i = %i, x = %i\n", (line * 8 + i), line, i, x);
-		//}
-		display.scan_line[x + i] = colour_code | data;
-		//put_pixel(s, x + i, y, display.bg_pal[pal].colour[colour_code]);
+/* draws the eight codes of one sprite row over px. a pixel is drawn when
+ * its code isn't 0 and the pixel under it has none of the hide bits set. */
+static inline void sprite_row_merge(Byte *px, const Byte *codes, const Byte data, const Byte hide) {
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	__m128i under = _mm_loadl_epi64((const __m128i *)px);
+	__m128i row = _mm_loadl_epi64((const __m128i *)codes);
+	__m128i draw;
+	draw = _mm_andnot_si128(_mm_cmpeq_epi8(row, zero),
+			_mm_cmpeq_epi8(_mm_and_si128(under, _mm_set1_epi8(hide)), zero));
+	row = _mm_or_si128(row, _mm_set1_epi8(data));
+	_mm_storel_epi64((__m128i *)px,
+			_mm_or_si128(_mm_and_si128(draw, row), _mm_andnot_si128(draw, under)));
+#else
+	int i;
+	for (i = 0; i < 8; i++) {
+		if (codes[i] && !(px[i] & hide))
+			px[i] = codes[i] | data;
 	}
+#endif
 }
 
-static void sprite_blit(Tile *t, const int x, int line, const int flip, const int pal, const int priority, const int h) {
-	int i = 0;
-	Byte colour_code;
-	Byte data;
-	Byte current_px;
-	int w = 8;
-
-	/* when drawing 8x16 sprites, we need to flip the two 8x8 tiles round */
-	if (h == 16) {
-		if (flip & Y_FLIP) {
-			if (line < 8) {
-				line += 8;
-			} else {
-				line -= 8;
-			}
-		}
-	}
-	if (line > 7) {
-		sprite_blit(t->next, x, line - 8, flip, pal, priority, 8);
+/* a sprite never covers a pixel with the bg priority bit (0x40) set. one
+ * drawn behind the background also leaves pixels that already have a
+ * sprite (0x20) or a bg colour other than 0. */
+static void sprite_blit(Byte *scan_line, Tile *t, const int x, int line, const int flip, const int pal, const int priority, const int h) {
+	Byte px[8] = {0};
+	const Byte hide = priority ? 0x63 : 0x40;
+	const Byte data = (pal << 2) | 0x20;
+	int first = 0, end = 8;
+
+	if ((x <= -8) || (x >= DISPLAY_W))
 		return;
-	}
-	if (x < 0) {
-		if (x < -7)
-			return;
-		i = -x;
-	} else if (x + w >= DISPLAY_W) {
-		if (x + w >= DISPLAY_W + 8)
-			return;
-		w = 8 - (x + w - DISPLAY_W);
-	}
+	/* the lower half of an 8x16 sprite is the next tile, or the upper half
+	 * when the sprite is flipped vertically */
+	if ((h == 16) && ((line > 7) != ((flip & Y_FLIP) != 0)))
+		t = t->next;
+	line &= 0x07;
 
-	if (t->cache_px[flip] == NULL)
+	if (!(__atomic_load_n(&t->cached_flips, __ATOMIC_ACQUIRE) & (1 << flip)))
 		tile_regenerate(t, flip);
 
-	data = 0 | (pal << 2) | 0x20;
-
-	for (; i < w; i++) {
-		colour_code = t->cache_px[flip][line * 8 + i];
-		current_px = display.scan_line[x + i];
-		if (current_px & 0x40)
-			continue;
-		if (colour_code != 0) {
-			if (priority) {
-				if (!(current_px & 0x20) && ((current_px & 0x03) == 0))
-					display.scan_line[x + i] = colour_code | data;
-			} else {
-				display.scan_line[x + i] = colour_code | data;
-			}
-		}
+	if (x < 0)
+		first = -x;
+	else if (x > DISPLAY_W - 8)
+		end = DISPLAY_W - x;
+	if ((first == 0) && (end == 8)) {
+		sprite_row_merge(scan_line + x, t->cache_px[flip] + line * 8, data, hide);
+		return;
 	}
+	/* clipped at a screen edge, so go through a whole row on the stack */
+	memcpy(px + first, scan_line + x + first, end - first);
+	sprite_row_merge(px, t->cache_px[flip] + line * 8, data, hide);
+	memcpy(scan_line + x + first, px + first, end - first);
 }
 
 void display_save(void) {
@@ -1004,6 +1661,8 @@ void display_load(void) {
 	display.vram_bank = load_uint("vram_bank");
 	set_vector_block(MEM_VIDEO, display.vram + (display.vram_bank * 0x2000), SIZE_VIDEO);
 	load_memory("oam", display.oam, SIZE_OAM);
+	display.is_sprite_index_dirty = 1;
+	bg_rows_dirty();
 	
 	display.is_hdma_active = load_uint("dma");
 	
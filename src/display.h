@@ -37,6 +37,7 @@
 #define OAM_CYCLES				(80)
 #define OAM_VRAM_CYCLES			(172 + OAM_CYCLES)
 #define HBLANK_CYCLES			(204 + OAM_VRAM_CYCLES)
+#define FRAME_CYCLES			(HBLANK_CYCLES * 154)
 
 #define BG_W					256
 #define BG_H					256
@@ -95,6 +96,25 @@
 
 #define VRAM_BANK_SIZE			0x2000
 
+/* gbc tile map attributes */
+enum { TILE_PALETTE 	= 0x07 };
+enum { TILE_VRAM_BANK 	= 0x08 };
+enum { TILE_X_FLIP 		= 0x20 };
+enum { TILE_Y_FLIP 		= 0x40 };
+enum { TILE_PRIORITY 	= 0x80 };
+
+/* how lines are drawn: all at once from the registers as they are at
+ * hblank, or a dot at a time through mode 3 by a pixel fifo */
+#define PPU_LINE				0
+#define PPU_FIFO				1
+#define PPUS					2
+
+/* how gbc colours are corrected for the host display */
+#define COLOUR_NONE				0
+#define COLOUR_GBC				1
+#define COLOUR_GBA				2
+#define COLOUR_PROFILES			3
+
 #define GB_FRAME_PERIOD ((HBLANK_CYCLES * 154 * 1000) / 4194304)
 
 //struct tile;
@@ -106,40 +126,87 @@ typedef struct palette {
 	Colour colour[4];
 } Palette;
 
+/* 256 tiles per tile data table, in each of the two gbc vram banks */
+#define TILE_CACHE_SIZE			512
+
+/* a tile and its decoded colour codes, one 8x8 block per flip. the blocks
+ * are only valid while their bit in cached_flips is set. */
 typedef struct tile {
 	struct tile* next;
 	Byte* vram_px;
-	Byte* cache_px[4];
+	unsigned int cached_flips;
+	/* bumped whenever the tile's data is written, for the tile viewer */
+	unsigned int version;
+	/* the cached background rows which use this tile, a bit for each row
+	 * of both tile maps */
+	uint64_t row_users;
+	Byte cache_px[4][8 * 8];
 } Tile;
 
+/* a frame as the lcd drew it: the scan line codes of each line, and the
+ * palettes each line was drawn with. the codes are only turned into
+ * colours by whatever shows, captures or hashes the frame. lines which
+ * were not drawn, while the lcd was off, have LINE_BLANK for a palette
+ * and come out white. */
+#define LINE_BLANK				0xff
+typedef struct {
+	Byte codes[DISPLAY_H][DISPLAY_W];
+	/* the index in pals of each line's palettes */
+	Byte line_pals[DISPLAY_H];
+	/* the distinct palettes of the frame, in the order they were used */
+	unsigned int pal_count;
+	Palette pals[DISPLAY_H][16];
+} Frame;
+
+/* the registers which affect how a line is drawn */
+typedef struct {
+	Byte lcdc, scx, scy, wx, wy;
+} LineRegs;
 
 typedef struct {
 	SDL_Surface *screen;
-	SDL_Surface *display;
+	/* the frame being drawn */
+	Frame *frame;
+	/* the pixel format the palettes' colours are in */
+	SDL_PixelFormat format;
 	//SDL_Palette background_palette[8];
 	//SDL_Palette sprite_palette[8];
 	//SDL_Color colours[4];
-	Palette bg_pal[8];
-	Palette spr_pal[8];
+	/* background palettes, then sprite palettes: the low 6 bits of a
+	 * scan_line code index the colours of all 16 directly */
+	Palette palettes[16];
+	Palette *bg_pal;
+	Palette *spr_pal;
 	Colour mono_colours[4];
 	Byte *gbc_bg_pal_mem;
 	Byte *gbc_spr_pal_mem;
 
 	unsigned int x_res, y_res, bpp;
 	unsigned int cycles;
+	/* master clock time the display was last brought up to date */
+	uint64_t last_sync;
 	Byte *vram;
 	Byte *oam;
 	//Uint32 palette_bg[4];
 	//Uint32 palette_sprite_0[4];
 	//Uint32 palette_sprite_1[4];
 	int sprite_height;
-	struct tile* tiles_tdt_0;
-	struct tile* tiles_tdt_1;
-	Byte* scan_line;
+	/* oam or the sprite height has changed since the sprite index was built */
+	int is_sprite_index_dirty;
+	/* bumped when a row of a tile map, or a tile it uses, is written */
+	unsigned int map_row_version[2][32];
+	struct tile tiles_tdt_0[TILE_CACHE_SIZE];
+	struct tile tiles_tdt_1[TILE_CACHE_SIZE];
 	//struct sprite* sprites;
 	unsigned int vram_bank;
 	unsigned int is_hdma_active;
 	unsigned int cache_size;
+	/* draw a frame at a time, rather than a line at a time */
+	int is_deferred;
+	/* PPU_LINE or PPU_FIFO */
+	unsigned int ppu;
+	/* the lines logged but not yet drawn */
+	unsigned int log_start, log_end;
 } Display;
 
 
@@ -160,15 +227,40 @@ typedef struct sprite {
 #endif
 
 
-void display_update(unsigned int cycles);
+void display_sync(void);
+void display_flush(void);
+void display_set_deferred(int is_deferred);
+void display_set_threaded(int is_threaded);
+void display_set_colour_profile(unsigned int profile);
+unsigned int display_get_colour_profile(void);
+const char *display_colour_profile_name(unsigned int profile);
+void display_set_raster_threads(unsigned int count);
+unsigned int display_get_raster_threads(void);
+void display_benchmark(void);
+void display_set_ppu(unsigned int ppu);
+unsigned int display_get_ppu(void);
+const char *display_ppu_name(unsigned int ppu);
+int display_find_ppu(const char *name);
+void display_line_palettes(const unsigned int ly, const Palette *pals);
+int display_is_threaded(void);
+void display_lock_video(void);
+int display_try_lock_video(void);
+void display_unlock_video(void);
+unsigned int display_next_event(void);
 void display_reset(void);
 void display_init(void);
 void display_fini(void);
 void draw_frame(void);
+void display_resolve(const Frame *frame, SDL_Surface *surface);
+void display_resolve_line(const Frame *frame, const int ly, Colour *row);
+size_t display_frame_size(const Frame *frame);
+SDL_Surface *display_create_surface(void);
 void update_bg_palette(unsigned n, Byte p);
 void update_sprite_palette(unsigned n, Byte p);
 Byte check_coincidence(Byte ly, Byte stat);
 void launch_dma(Byte address);
+void tile_rows_dirty(Tile *t);
+const Byte *display_tile_codes(Tile *t, const int flip);
 void start_hdma(Byte hdma5);
 void display_save(void);
 void display_load(void);
@@ -181,12 +273,16 @@ static inline void write_vram(const Word address, const Byte value);
 static inline Byte read_vram(const Word address);
 static inline void write_oam(const Word address, const Byte value);
 static inline Byte read_oam(const Word address);
-static void tile_dirty(Tile *t);
+static inline void tile_dirty(Tile *t);
+static inline void display_ppu_sync(void);
 //static inline void sprite_invalidate(Sprite *sprite);
 
 
 static inline void write_vram(const Word address, const Byte value) {
 	extern Display display;
+	display_ppu_sync();
+	if (display.log_start != display.log_end)
+		display_flush();
 	// NO else here, tile data tables overlap!
 	if ((address >= TDT_0) && (address < (TDT_0 + TDT_0_LEN))) {
 		tile_dirty(&display.tiles_tdt_0[(display.vram_bank * 256) + ((address - TDT_0) >> 4)]);
@@ -194,6 +290,8 @@ static inline void write_vram(const Word address, const Byte value) {
 	}
 	if ((address >= TDT_1) && (address < (TDT_1 + TDT_1_LEN)))
 		tile_dirty(&display.tiles_tdt_1[(display.vram_bank * 256) + ((address - TDT_1) >> 4)]);
+	if (address >= TILE_MAP_0)
+		++display.map_row_version[(address - TILE_MAP_0) >> 10][((address - TILE_MAP_0) >> 5) & 0x1F];
     display.vram[address - MEM_VIDEO + (display.vram_bank * 0x2000)] = value;
 }
 
@@ -204,7 +302,11 @@ static inline Byte read_vram(const Word address) {
 
 static inline void write_oam(const Word address, const Byte value) {
 	extern Display display;
-    display.vram[address - MEM_OAM] = value;
+	display_ppu_sync();
+	if (display.log_start != display.log_end)
+		display_flush();
+    display.oam[address - MEM_OAM] = value;
+	display.is_sprite_index_dirty = 1;
 }
 
 static inline Byte read_oam(const Word address) {
@@ -221,14 +323,20 @@ static inline void sprite_invalidate(Sprite *sprite) {
 }
 */
 
-static void tile_dirty(Tile *t) {
-	int i;
-	for (i = 0; i < 4; i++) {
-		if (t->cache_px[i] != NULL) {
-			free(t->cache_px[i]);
-			t->cache_px[i] = NULL;
-		}
-	}
+/* the fifo ppu draws as the lcd runs, so it is brought up to the current
+ * dot before anything it reads changes. the line ppu reads nothing until
+ * hblank, and doesn't need it. */
+static inline void display_ppu_sync(void) {
+	extern Display display;
+	if (display.ppu == PPU_FIFO)
+		display_sync();
+}
+
+static inline void tile_dirty(Tile *t) {
+	t->cached_flips = 0;
+	++t->version;
+	if (t->row_users != 0)
+		tile_rows_dirty(t);
 }
 
 
@@ -0,0 +1,376 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of jonny nor the name of any other
+ *    contributor may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY jonny AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL jonny OR ANY OTHER
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, 
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+ 
+#include <stdint.h>
+#include <string.h>
+#include "fifo.h"
+#include "display.h"
+#include "memory.h"
+#include "stats.h"
+
+/* mode 3 is a fixed 172 dots here. the fetcher starts after a few dots,
+ * and a pixel is shifted out on each of the last 160. the lcd doesn't
+ * stall for sprites or the window, since mode 3 can't get longer. */
+#define MODE3_DOTS			(OAM_VRAM_CYCLES - OAM_CYCLES)
+#define FETCH_DOT			6
+#define PIXEL_DOT			(MODE3_DOTS - DISPLAY_W)
+
+/* bg fifo codes carry the gbc priority attribute in a bit the frame
+ * doesn't use */
+#define BG_PRIORITY			0x40
+
+/* a pixel of the sprite fifo, 0 if no sprite has one here yet */
+typedef struct {
+	Byte code;
+	Byte oam;
+	Byte is_behind;
+} SpritePixel;
+
+typedef struct {
+	int is_active;
+	Byte ly;
+	/* the next dot of mode 3 to run, and the next pixel to shift out */
+	unsigned int dot;
+	unsigned int x;
+	/* the background fifo holds codes with the palette number as the
+	 * game set it, before the line's palette slots are applied */
+	Byte bg[16];
+	unsigned int head, count;
+	/* pixels to throw away before the next one is shifted out: the fine
+	 * scroll at the start of a line, or of a window left of the screen */
+	unsigned int discard;
+	/* the next tile the fetcher pushes, counted from the background's or
+	 * window's first */
+	unsigned int fetch_x;
+	int is_window;
+	int is_window_line;
+	/* the sprites the oam scan found, in the order they are fetched, and
+	 * the x the next one is fetched at */
+	Byte sprites[MAX_SPRITES_PER_LINE];
+	unsigned int sprite_count, next_sprite;
+	int sprite_height;
+	int next_sprite_x;
+	/* the sprite fifo, each pixel at screen x & 7 */
+	SpritePixel spr[8];
+	/* the window's own line counter, which only moves on lines the window
+	 * is drawn on, and whether ly has met wy this frame */
+	unsigned int window_line;
+	int is_wy_matched;
+	/* the palettes the line is drawn with. a palette changed part way
+	 * through the line moves to a slot no code uses, so the pixels already
+	 * out keep their colours. free_slots is a bit per slot. */
+	Palette pals[16];
+	Byte pal_slot[16];
+	unsigned int free_slots;
+} Fifo;
+
+static void oam_scan(const Byte lcdc);
+static void next_sprite(void);
+static void fetch_tile(const LineRegs *regs);
+static void fetch_sprite(const unsigned int sprite);
+static void shift_pixel(const LineRegs *regs);
+static void line_finish(void);
+
+static Fifo fifo;
+
+static Counter fifo_line_counter = { "lines rendered (fifo)" };
+static int is_registered = 0;
+
+extern Display display;
+extern int console_mode;
+
+/* forgets any line left part drawn when the ppu was last switched away.
+ * the window line count is lost too, so a window already showing waits
+ * for the next frame. */
+void fifo_reset(void) {
+	memset(&fifo, 0, sizeof(fifo));
+}
+
+/* the oam scan, and everything the lcd latches as it starts a line */
+void fifo_line_start(const Byte ly) {
+	const Byte lcdc = read_io(HWREG_LCDC);
+	unsigned int i;
+	if (!is_registered) {
+		stats_register(&fifo_line_counter);
+		is_registered = 1;
+	}
+	if (ly == 0) {
+		fifo.window_line = 0;
+		fifo.is_wy_matched = 0;
+	}
+	if (ly == read_io(HWREG_WY))
+		fifo.is_wy_matched = 1;
+	fifo.ly = ly;
+	fifo.dot = 0;
+	fifo.x = 0;
+	fifo.head = fifo.count = 0;
+	fifo.discard = read_io(HWREG_SCX) & 0x07;
+	fifo.fetch_x = 0;
+	fifo.is_window = 0;
+	fifo.is_window_line = 0;
+	memset(fifo.spr, 0, sizeof(fifo.spr));
+	oam_scan(lcdc);
+	memcpy(fifo.pals, display.palettes, sizeof(fifo.pals));
+	for (i = 0; i < 16; i++)
+		fifo.pal_slot[i] = i;
+	/* the dmg only uses bg palette 0 and sprite palettes 0 and 1 */
+	if (console_mode == MODE_GBC_ENABLED)
+		fifo.free_slots = 0;
+	else
+		fifo.free_slots = 0xffff & ~((1 << 0) | (1 << 8) | (1 << 9));
+	fifo.is_active = 1;
+}
+
+/* runs mode 3 up to dot. anything which changes the registers syncs the
+ * display first, so they hold still for the whole run, and lcdc, like the
+ * scroll and window registers, takes effect part way through a line. */
+void fifo_line_run(const Byte ly, const unsigned int dot) {
+	const unsigned int end = (dot < MODE3_DOTS) ? dot : MODE3_DOTS;
+	LineRegs regs;
+	if (!fifo.is_active || (ly != fifo.ly) || (fifo.dot >= end))
+		return;
+	regs.lcdc = read_io(HWREG_LCDC);
+	regs.scx = read_io(HWREG_SCX);
+	regs.scy = read_io(HWREG_SCY);
+	regs.wx = read_io(HWREG_WX);
+	regs.wy = read_io(HWREG_WY);
+	for (; fifo.dot < end; fifo.dot++) {
+		if (fifo.dot < FETCH_DOT)
+			continue;
+		if (fifo.count <= 8)
+			fetch_tile(&regs);
+		if (fifo.dot >= PIXEL_DOT)
+			shift_pixel(&regs);
+	}
+}
+
+/* runs what is left of mode 3. if the line was never started, as when
+ * the ppu has just been switched, it is drawn from its start. */
+void fifo_line_end(const Byte lcdc, const Byte ly) {
+	if (!fifo.is_active || (ly != fifo.ly))
+		fifo_line_start(ly);
+	fifo_line_run(ly, MODE3_DOTS);
+	line_finish();
+	counter_inc(&fifo_line_counter);
+}
+
+/* palette n has changed. pixels already shifted out keep the old colours
+ * if there is a free slot to put the new ones in. */
+void fifo_palette(const unsigned int n) {
+	const unsigned int half = n & 0x08;
+	unsigned int slot;
+	if (!fifo.is_active)
+		return;
+	if (fifo.x > 0) {
+		for (slot = half; slot < half + 8; slot++) {
+			if (fifo.free_slots & (1 << slot)) {
+				fifo.free_slots &= ~(1 << slot);
+				fifo.pal_slot[n] = slot;
+				break;
+			}
+		}
+	}
+	fifo.pals[fifo.pal_slot[n]] = display.palettes[n];
+}
+
+/* draws every line again from the registers as they are now, for the
+ * benchmark, leaving the fifo as it was */
+void fifo_frame(void) {
+	Fifo saved = fifo;
+	unsigned int ly;
+	for (ly = 0; ly < DISPLAY_H; ly++) {
+		fifo_line_start(ly);
+		fifo_line_run(ly, MODE3_DOTS);
+		line_finish();
+	}
+	fifo = saved;
+}
+
+static void line_finish(void) {
+	if (fifo.is_window_line)
+		fifo.window_line++;
+	display_line_palettes(fifo.ly, fifo.pals);
+	fifo.is_active = 0;
+}
+
+/* the first MAX_SPRITES_PER_LINE sprites in oam on the line. they are
+ * fetched left to right, in oam order between equals. */
+static void oam_scan(const Byte lcdc) {
+	const Byte *oam;
+	unsigned int i, j;
+	int y;
+	fifo.sprite_count = 0;
+	fifo.next_sprite = 0;
+	fifo.sprite_height = (lcdc & 0x04) ? 16 : 8;
+	for (i = 0; (i < OAM_BLOCKS) && (fifo.sprite_count < MAX_SPRITES_PER_LINE); i++) {
+		oam = display.oam + (i * OAM_BLOCK_SIZE);
+		y = fifo.ly - (oam[OAM_YPOS] - 16);
+		if ((y < 0) || (y >= fifo.sprite_height))
+			continue;
+		for (j = fifo.sprite_count; (j > 0) &&
+				(display.oam[(fifo.sprites[j - 1] * OAM_BLOCK_SIZE) + OAM_XPOS] > oam[OAM_XPOS]); j--)
+			fifo.sprites[j] = fifo.sprites[j - 1];
+		fifo.sprites[j] = i;
+		fifo.sprite_count++;
+	}
+	next_sprite();
+}
+
+static void next_sprite(void) {
+	if (fifo.next_sprite < fifo.sprite_count)
+		fifo.next_sprite_x = display.oam[(fifo.sprites[fifo.next_sprite] * OAM_BLOCK_SIZE) + OAM_XPOS] - 8;
+	else
+		fifo.next_sprite_x = DISPLAY_W;
+}
+
+/* pushes the next tile's row of the background or window. scx and scy
+ * are read as each tile is fetched. */
+static void fetch_tile(const LineRegs *regs) {
+	const Byte lcdc = regs->lcdc;
+	const Byte *map;
+	const Byte *px;
+	unsigned int column, y, tile_code, i;
+	Byte attrib = 0;
+	Byte data;
+	Tile *t;
+	if (fifo.is_window) {
+		map = display.vram + ((lcdc & 0x40) ? TILE_MAP_1 : TILE_MAP_0) - MEM_VIDEO;
+		column = fifo.fetch_x & 31;
+		y = fifo.window_line & 0xff;
+	} else {
+		map = display.vram + ((lcdc & 0x08) ? TILE_MAP_1 : TILE_MAP_0) - MEM_VIDEO;
+		column = ((regs->scx >> 3) + fifo.fetch_x) & 31;
+		y = (fifo.ly + regs->scy) & 0xff;
+	}
+	fifo.fetch_x++;
+	/* on the dmg, lcdc bit 0 blanks the background and window */
+	if ((console_mode != MODE_GBC_ENABLED) && !(lcdc & 0x01)) {
+		for (i = 0; i < 8; i++)
+			fifo.bg[(fifo.head + fifo.count + i) & 15] = 0;
+		fifo.count += 8;
+		return;
+	}
+	map += ((y / 8) * 32) + column;
+	tile_code = map[0];
+	if (console_mode == MODE_GBC_ENABLED)
+		attrib = map[VRAM_BANK_SIZE];
+	if (attrib & TILE_VRAM_BANK)
+		tile_code += 256;
+	if (lcdc & 0x10)
+		t = &display.tiles_tdt_0[tile_code];
+	else
+		t = &display.tiles_tdt_1[tile_code ^ 0x80];
+	px = display_tile_codes(t, (attrib >> 5) & 0x03) + ((y & 0x07) * 8);
+	data = ((attrib & TILE_PALETTE) << 2) | ((attrib & TILE_PRIORITY) ? BG_PRIORITY : 0);
+	for (i = 0; i < 8; i++)
+		fifo.bg[(fifo.head + fifo.count + i) & 15] = px[i] | data;
+	fifo.count += 8;
+}
+
+/* merges a sprite's row into the sprite fifo. a pixel a sprite already
+ * holds is kept: the earlier fetched sprite wins on the dmg, and the
+ * earlier one in oam on the gbc. */
+static void fetch_sprite(const unsigned int sprite) {
+	const Byte *oam = display.oam + (sprite * OAM_BLOCK_SIZE);
+	const Byte flags = oam[OAM_FLAGS];
+	const int flip = (flags >> 5) & 0x03;
+	const int sx = oam[OAM_XPOS] - 8;
+	int line = fifo.ly - (oam[OAM_YPOS] - 16);
+	unsigned int tile_code = oam[OAM_PATTERN];
+	const Byte *px;
+	Byte data;
+	SpritePixel *s;
+	int i, p;
+	if (fifo.sprite_height == 16) {
+		tile_code &= 0xfe;
+		/* the lower tile, or the upper one when flipped */
+		if ((line > 7) != ((flip & Y_FLIP) != 0))
+			tile_code |= 0x01;
+		line &= 0x07;
+	}
+	if (console_mode == MODE_GBC_ENABLED) {
+		if (flags & 0x08)
+			tile_code += 256;
+		data = 0x20 | ((flags & 0x07) << 2);
+	} else {
+		data = 0x20 | (((flags >> 4) & 0x01) << 2);
+	}
+	px = display_tile_codes(&display.tiles_tdt_0[tile_code], flip) + (line * 8);
+	for (i = 0; i < 8; i++) {
+		p = sx + i;
+		if ((p < (int)fifo.x) || (p >= DISPLAY_W) || (px[i] == 0))
+			continue;
+		s = &fifo.spr[p & 0x07];
+		if ((s->code != 0) && !((console_mode == MODE_GBC_ENABLED) && (sprite < s->oam)))
+			continue;
+		s->code = px[i] | data;
+		s->oam = sprite;
+		s->is_behind = flags >> 7;
+	}
+}
+
+/* shifts one pixel out to the frame, mixing in the sprite fifo's */
+static void shift_pixel(const LineRegs *regs) {
+	const Byte lcdc = regs->lcdc;
+	const Byte wx = regs->wx;
+	SpritePixel *s;
+	Byte code;
+	/* the window starts when x reaches wx - 7, and throws the background
+	 * fifo away */
+	if (!fifo.is_window && (lcdc & 0x20) && fifo.is_wy_matched &&
+			(fifo.x == ((wx < 7) ? 0 : wx - 7))) {
+		fifo.is_window = 1;
+		fifo.is_window_line = 1;
+		fifo.head = fifo.count = 0;
+		fifo.fetch_x = 0;
+		fetch_tile(regs);
+		fifo.discard = (wx < 7) ? 7 - wx : 0;
+	}
+	while (fifo.discard > 0) {
+		fifo.head = (fifo.head + 1) & 15;
+		fifo.count--;
+		fifo.discard--;
+	}
+	if ((lcdc & 0x02) && (fifo.next_sprite_x <= (int)fifo.x)) {
+		do {
+			fetch_sprite(fifo.sprites[fifo.next_sprite++]);
+			next_sprite();
+		} while (fifo.next_sprite_x <= (int)fifo.x);
+	}
+	code = fifo.bg[fifo.head];
+	fifo.head = (fifo.head + 1) & 15;
+	fifo.count--;
+	/* a sprite goes behind bg colours 1-3 if it or the tile asks to,
+	 * unless lcdc bit 0 on the gbc says sprites always go on top */
+	s = &fifo.spr[fifo.x & 0x07];
+	if (s->code != 0) {
+		if (((console_mode == MODE_GBC_ENABLED) && !(lcdc & 0x01)) ||
+				!((code & 0x03) && (s->is_behind || (code & BG_PRIORITY))))
+			code = s->code;
+		s->code = 0;
+	}
+	display.frame->codes[fifo.ly][fifo.x++] = (code & 0x03) | (fifo.pal_slot[(code >> 2) & 0x0f] << 2);
+}
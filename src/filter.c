@@ -0,0 +1,718 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of jonny nor the name of any other
+ *    contributor may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY jonny AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL jonny OR ANY OTHER
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, 
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <SDL/SDL.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filter.h"
+#include "scale.h"
+#include "stats.h"
+
+/* a frame is filtered in passes. each pass is split into bands of rows,
+ * which the filter threads take in turn until none are left; the calling
+ * thread works on bands too. */
+#define MAX_FILTER_THREADS	8
+#define BAND_ROWS			8
+#define BENCHMARK_FRAMES	50
+/* source rows either side of a pixel which the filters read */
+#define FILTER_REACH		2
+
+/* the source and destination of the current pass. pitches are in pixels */
+typedef struct {
+	const Uint32 *src;
+	int src_pitch;
+	int w, h;
+	Uint32 *dest;
+	int dest_pitch;
+} Pass;
+
+typedef void (*BandFunc)(const int y0, const int y1);
+
+/* a filter scales source rows y0 to y1 (exclusive) of src up to dest.
+ * its output is factor times the size of src, in the middle of dest */
+typedef struct {
+	const char *name;
+	void (*run)(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1);
+	int factor;
+} Filter;
+
+static void run_none(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1);
+static void run_scale2x(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1);
+static void run_scale3x(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1);
+static void run_scale4x(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1);
+static void run_lut2x(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1);
+static void run_lut4x(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1);
+static void run_xbr(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1);
+
+static void run_pass(BandFunc f, SDL_Surface *src, SDL_Surface *dest, int y0, int y1);
+static void run_yuv(SDL_Surface *src, const int y0, const int y1);
+static void do_bands(void);
+static int band_loop(void *data);
+static SDL_Surface *get_temp(const int n, SDL_Surface *src, const int factor);
+static void copy_centred(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1);
+static void lut_init(void);
+
+static void yuv_rows(const int y0, const int y1);
+static void scale2x_rows(const int y0, const int y1);
+static void scale3x_rows(const int y0, const int y1);
+static void lut2x_rows(const int y0, const int y1);
+static void lut4x_rows(const int y0, const int y1);
+static void xbr_rows(const int y0, const int y1);
+
+static const Filter filters[FILTER_COUNT] = {
+	{ "none", run_none, 4 },
+	{ "scale2x", run_scale2x, 4 },
+	{ "scale3x", run_scale3x, 3 },
+	{ "scale4x", run_scale4x, 4 },
+	{ "lut2x", run_lut2x, 4 },
+	{ "lut4x", run_lut4x, 4 },
+	{ "2xbr", run_xbr, 4 }
+};
+static unsigned int filter = FILTER_NONE;
+
+static Pass pass;
+/* the yuv of each source pixel, as y << 16 | u << 8 | v */
+static uint32_t *yuv = NULL;
+static int yuv_size = 0;
+/* intermediate frames, at 2x and 3x */
+static SDL_Surface *temps[2];
+
+static SDL_Thread *threads[MAX_FILTER_THREADS];
+static SDL_sem *band_sems[MAX_FILTER_THREADS];
+static SDL_sem *band_done_sem;
+static unsigned int thread_count = 1;
+static unsigned int threads_started = 1;
+static volatile int is_filter_quit;
+static BandFunc band_func;
+static int band_first;
+static int band_end;
+static int band_total;
+static volatile int next_band;
+
+/* the lut filters look at whether each of the 8 neighbours differs from the
+ * centre pixel, and whether the two edge neighbours at each corner are
+ * alike. lut_table maps those 12 bits to how each corner is blended: 2 bits
+ * per corner, top left first, going clockwise. there is a table for 2x
+ * and one for 4x, which differ only for lone pixels. the idea is hqx's,
+ * but the table comes from these corner rules rather than its case
+ * tables, so the output is not the same. */
+enum {
+	LUT_NONE,		/* the centre pixel */
+	LUT_BOTH,		/* some of both edge neighbours, which differ */
+	LUT_EDGE,		/* an edge meets the centre colour running on diagonally */
+	LUT_EDGE_SOLID,	/* an edge cuts the corner, with the diagonal behind it */
+	LUT_MODES
+};
+static Byte lut_table[2][1 << 12];
+/* eighths of the centre, first edge, second edge and diagonal neighbour, for
+ * the corner pixel, the pixel beside it on the first edge, the one beside
+ * it on the second edge and the inner pixel of a corner */
+static const Byte lut_weights[LUT_MODES][4][4] = {
+	{ { 8, 0, 0, 0 }, { 8, 0, 0, 0 }, { 8, 0, 0, 0 }, { 8, 0, 0, 0 } },
+	{ { 4, 2, 2, 0 }, { 6, 2, 0, 0 }, { 6, 0, 2, 0 }, { 8, 0, 0, 0 } },
+	{ { 6, 1, 1, 0 }, { 8, 0, 0, 0 }, { 8, 0, 0, 0 }, { 8, 0, 0, 0 } },
+	{ { 0, 4, 4, 0 }, { 4, 2, 2, 0 }, { 4, 2, 2, 0 }, { 8, 0, 0, 0 } }
+};
+/* the pattern bits of each corner's first edge, second edge and diagonal
+ * neighbours, numbered w1 - w9 left to right, top to bottom, without w5 */
+static const Byte lut_corners[4][3] = {
+	{ 0x08, 0x02, 0x01 },	/* top left: w4, w2, w1 */
+	{ 0x02, 0x10, 0x04 },	/* top right: w2, w6, w3 */
+	{ 0x10, 0x40, 0x80 },	/* bottom right: w6, w8, w9 */
+	{ 0x40, 0x08, 0x20 }	/* bottom left: w8, w4, w7 */
+};
+
+/* the 5x5 neighbourhood of a pixel, rotated so each corner in turn is at
+ * the bottom right, as xbr_corner() expects */
+static Byte xbr_rot[4][25];
+
+void filter_init(void) {
+	int k, r, c;
+	lut_init();
+	for (r = 0; r < 5; r++) {
+		for (c = 0; c < 5; c++) {
+			xbr_rot[0][r * 5 + c] = (4 - r) * 5 + (4 - c);	/* top left */
+			xbr_rot[1][r * 5 + c] = (4 - c) * 5 + r;		/* top right */
+			xbr_rot[2][r * 5 + c] = r * 5 + c;				/* bottom right */
+			xbr_rot[3][r * 5 + c] = c * 5 + (4 - r);		/* bottom left */
+		}
+	}
+	band_done_sem = SDL_CreateSemaphore(0);
+	for (k = 0; k < 2; k++)
+		temps[k] = NULL;
+}
+
+void filter_fini(void) {
+	int i;
+	is_filter_quit = 1;
+	for (i = 1; i < threads_started; i++) {
+		SDL_SemPost(band_sems[i]);
+		SDL_WaitThread(threads[i], NULL);
+		SDL_DestroySemaphore(band_sems[i]);
+	}
+	SDL_DestroySemaphore(band_done_sem);
+	for (i = 0; i < 2; i++) {
+		if (temps[i] != NULL)
+			SDL_FreeSurface(temps[i]);
+	}
+	free(yuv);
+}
+
+/* scales src up to dest, which is 4x its size, through the current filter */
+void filter_frame(SDL_Surface *src, SDL_Surface *dest) {
+	filters[filter].run(src, dest, 0, src->h);
+}
+
+/* scales only source rows y0 to y1 (exclusive), for partial updates, and
+ * sets rect to the part of dest drawn. the rows of dest they reach through
+ * the filter's neighbourhood beyond them are left alone, so the caller
+ * widens the range to cover those */
+void filter_frame_rows(SDL_Surface *src, SDL_Surface *dest, int y0, int y1, SDL_Rect *rect) {
+	const int factor = filters[filter].factor;
+	filters[filter].run(src, dest, y0, y1);
+	rect->x = 0;
+	rect->y = ((dest->h - (src->h * factor)) / 2) + (y0 * factor);
+	rect->w = dest->w;
+	rect->h = (y1 - y0) * factor;
+}
+
+void filter_set(unsigned int f) {
+	filter = f % FILTER_COUNT;
+}
+
+unsigned int filter_get(void) {
+	return filter;
+}
+
+const char *filter_name(unsigned int f) {
+	return filters[f].name;
+}
+
+/* sets the number of threads filtering a frame, including the caller. the
+ * render thread may be filtering, so hold display_lock_video() around this */
+void filter_set_threads(unsigned int count) {
+	if (count < 1)
+		count = 1;
+	if (count > MAX_FILTER_THREADS)
+		count = MAX_FILTER_THREADS;
+	for (; threads_started < count; threads_started++) {
+		band_sems[threads_started] = SDL_CreateSemaphore(0);
+		threads[threads_started] = SDL_CreateThread(band_loop, band_sems[threads_started]);
+		if (threads[threads_started] == NULL) {
+			fprintf(stderr, "could not create filter thread: %s\n", SDL_GetError());
+			exit(1);
+		}
+	}
+	thread_count = count;
+}
+
+/* times every filter on a copy of frame, on 1, 2, 4 and 8 threads. this
+ * uses the band pool too, so hold display_lock_video() around it */
+void filter_benchmark(SDL_Surface *frame) {
+	static const unsigned int counts[] = {1, 2, 4, 8};
+	unsigned int saved_threads = thread_count;
+	SDL_Surface *dest;
+	uint64_t start;
+	unsigned int f, i, j;
+	dest = SDL_CreateRGBSurface(SDL_SWSURFACE, frame->w * 4, frame->h * 4, 32,
+			frame->format->Rmask, frame->format->Gmask, frame->format->Bmask, 0);
+	for (f = 0; f < FILTER_COUNT; f++) {
+		printf("filter benchmark: %-8s:", filters[f].name);
+		for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+			filter_set_threads(counts[i]);
+			start = stats_now();
+			for (j = 0; j < BENCHMARK_FRAMES; j++)
+				filters[f].run(frame, dest, 0, frame->h);
+			printf(" %ut %7.1fus", counts[i], (stats_now() - start) / BENCHMARK_FRAMES / 1000.0);
+		}
+		printf("\n");
+	}
+	filter_set_threads(saved_threads);
+	SDL_FreeSurface(dest);
+}
+
+static void run_none(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1) {
+	scale_nn_rows(src, dest, 4, y0, y1);
+}
+
+static void run_scale2x(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1) {
+	SDL_Surface *t = get_temp(0, src, 2);
+	run_pass(scale2x_rows, src, t, y0, y1);
+	scale_nn_rows(t, dest, 2, y0 * 2, y1 * 2);
+}
+
+/* scale3x is shown at 3x in the middle of the screen: stretching it to
+ * 4x would double every third pixel and undo its edges */
+static void run_scale3x(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1) {
+	SDL_Surface *t = get_temp(1, src, 3);
+	run_pass(scale3x_rows, src, t, y0, y1);
+	copy_centred(t, dest, y0 * 3, y1 * 3);
+}
+
+/* scale4x is scale2x twice. the second pass reads a row either side of
+ * its rows, so the first makes them too: the intermediate frame is shared
+ * with other filters, and may not hold them */
+static void run_scale4x(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1) {
+	SDL_Surface *t = get_temp(0, src, 2);
+	run_pass(scale2x_rows, src, t, y0 - 1, y1 + 1);
+	run_pass(scale2x_rows, t, dest, y0 * 2, y1 * 2);
+}
+
+static void run_lut2x(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1) {
+	SDL_Surface *t = get_temp(0, src, 2);
+	run_yuv(src, y0, y1);
+	run_pass(lut2x_rows, src, t, y0, y1);
+	scale_nn_rows(t, dest, 2, y0 * 2, y1 * 2);
+}
+
+static void run_lut4x(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1) {
+	run_yuv(src, y0, y1);
+	run_pass(lut4x_rows, src, dest, y0, y1);
+}
+
+static void run_xbr(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1) {
+	SDL_Surface *t = get_temp(0, src, 2);
+	run_yuv(src, y0, y1);
+	run_pass(xbr_rows, src, t, y0, y1);
+	scale_nn_rows(t, dest, 2, y0 * 2, y1 * 2);
+}
+
+/* runs f over rows y0 to y1 (exclusive) of src, in bands spread across
+ * the threads. the range is clipped to src */
+static void run_pass(BandFunc f, SDL_Surface *src, SDL_Surface *dest, int y0, int y1) {
+	/* every post must be matched by a wait */
+	const unsigned int count = thread_count;
+	unsigned int i;
+	if (y0 < 0)
+		y0 = 0;
+	if (y1 > src->h)
+		y1 = src->h;
+	if (y0 >= y1)
+		return;
+	pass.src = src->pixels;
+	pass.src_pitch = src->pitch / 4;
+	pass.w = src->w;
+	pass.h = src->h;
+	if (dest != NULL) {
+		pass.dest = dest->pixels;
+		pass.dest_pitch = dest->pitch / 4;
+	}
+	band_func = f;
+	band_first = y0;
+	band_end = y1;
+	band_total = (y1 - y0 + BAND_ROWS - 1) / BAND_ROWS;
+	next_band = 0;
+	__sync_synchronize();
+	for (i = 1; i < count; i++)
+		SDL_SemPost(band_sems[i]);
+	do_bands();
+	for (i = 1; i < count; i++)
+		SDL_SemWait(band_done_sem);
+}
+
+/* converts rows y0 to y1 of src to yuv, for the filters which compare
+ * colours, along with the rows around them which the filters read */
+static void run_yuv(SDL_Surface *src, const int y0, const int y1) {
+	if (yuv_size < src->w * src->h) {
+		free(yuv);
+		yuv_size = src->w * src->h;
+		yuv = malloc(yuv_size * sizeof(uint32_t));
+		if (yuv == NULL) {
+			fprintf(stderr, "could not allocate filter buffer\n");
+			exit(1);
+		}
+	}
+	run_pass(yuv_rows, src, NULL, y0 - FILTER_REACH, y1 + FILTER_REACH);
+}
+
+static void do_bands(void) {
+	int band, end;
+	while ((band = __sync_fetch_and_add(&next_band, 1)) < band_total) {
+		end = band_first + ((band + 1) * BAND_ROWS);
+		band_func(band_first + (band * BAND_ROWS), (end < band_end) ? end : band_end);
+	}
+}
+
+static int band_loop(void *data) {
+	SDL_sem *sem = data;
+	while (1) {
+		SDL_SemWait(sem);
+		if (is_filter_quit)
+			break;
+		do_bands();
+		SDL_SemPost(band_done_sem);
+	}
+	return 0;
+}
+
+/* copies rows y0 to y1 (exclusive) of src into the middle of dest. the
+ * black border round it is drawn with the whole frame */
+static void copy_centred(SDL_Surface *src, SDL_Surface *dest, const int y0, const int y1) {
+	const int left = (dest->w - src->w) / 2;
+	const int top = (dest->h - src->h) / 2;
+	const Uint32 black = SDL_MapRGB(dest->format, 0, 0, 0);
+	SDL_Rect border[4] = {
+		{ 0, 0, dest->w, top },
+		{ 0, top + src->h, dest->w, dest->h - top - src->h },
+		{ 0, top, left, src->h },
+		{ left + src->w, top, dest->w - left - src->w, src->h }
+	};
+	int y, i;
+	if ((y0 == 0) && (y1 == src->h)) {
+		for (i = 0; i < 4; i++)
+			SDL_FillRect(dest, &border[i], black);
+	}
+	for (y = y0; y < y1; y++)
+		memcpy((Uint8 *)dest->pixels + (dest->pitch * (top + y)) + (left * 4),
+				(Uint8 *)src->pixels + (src->pitch * y), src->w * 4);
+}
+
+/* returns intermediate frame n, factor times the size of src */
+static SDL_Surface *get_temp(const int n, SDL_Surface *src, const int factor) {
+	if ((temps[n] != NULL) && (temps[n]->w == src->w * factor) && (temps[n]->h == src->h * factor))
+		return temps[n];
+	if (temps[n] != NULL)
+		SDL_FreeSurface(temps[n]);
+	temps[n] = SDL_CreateRGBSurface(SDL_SWSURFACE, src->w * factor, src->h * factor, 32,
+			src->format->Rmask, src->format->Gmask, src->format->Bmask, 0);
+	if (temps[n] == NULL) {
+		fprintf(stderr, "could not create filter surface: %s\n", SDL_GetError());
+		exit(1);
+	}
+	return temps[n];
+}
+
+/* source rows, clamped at the top and bottom edges */
+static inline const Uint32 *src_row(int y) {
+	if (y < 0)
+		y = 0;
+	else if (y >= pass.h)
+		y = pass.h - 1;
+	return pass.src + (pass.src_pitch * y);
+}
+
+/* blends four pixels by weights in eighths, a channel pair at a time */
+static inline Uint32 blend(const Uint32 c, const Uint32 a, const Uint32 b,
+			const Uint32 d, const Byte *w) {
+	uint32_t rb = ((c & 0xFF00FF) * w[0] + (a & 0xFF00FF) * w[1]
+			+ (b & 0xFF00FF) * w[2] + (d & 0xFF00FF) * w[3]) >> 3;
+	uint32_t g = ((c & 0x00FF00) * w[0] + (a & 0x00FF00) * w[1]
+			+ (b & 0x00FF00) * w[2] + (d & 0x00FF00) * w[3]) >> 3;
+	return (c & 0xFF000000) | (rb & 0xFF00FF) | (g & 0x00FF00);
+}
+
+/* pixels are taken to be 0x00RRGGBB, as the frames are created */
+static void yuv_rows(const int y0, const int y1) {
+	const Uint32 *p;
+	int r, g, b;
+	int x, y;
+	for (y = y0; y < y1; y++) {
+		p = pass.src + (pass.src_pitch * y);
+		for (x = 0; x < pass.w; x++) {
+			r = (p[x] >> 16) & 0xFF;
+			g = (p[x] >> 8) & 0xFF;
+			b = p[x] & 0xFF;
+			yuv[y * pass.w + x] = (((299 * r + 587 * g + 114 * b) / 1000) << 16)
+					| (((-169 * r - 331 * g + 500 * b) / 1000 + 128) << 8)
+					| ((500 * r - 419 * g - 81 * b) / 1000 + 128);
+		}
+	}
+}
+
+/* scale2x: a corner takes the colour of its two edge neighbours when they
+ * match each other, but not the neighbours across from them */
+static void scale2x_rows(const int y0, const int y1) {
+	const Uint32 *above, *row, *below;
+	Uint32 *d0, *d1;
+	Uint32 B, D, E, F, H;
+	int x, y;
+	for (y = y0; y < y1; y++) {
+		above = src_row(y - 1);
+		row = src_row(y);
+		below = src_row(y + 1);
+		d0 = pass.dest + (pass.dest_pitch * y * 2);
+		d1 = d0 + pass.dest_pitch;
+		for (x = 0; x < pass.w; x++) {
+			B = above[x];
+			D = row[(x > 0) ? x - 1 : 0];
+			E = row[x];
+			F = row[(x < pass.w - 1) ? x + 1 : x];
+			H = below[x];
+			if ((B != H) && (D != F)) {
+				d0[0] = (D == B) ? D : E;
+				d0[1] = (B == F) ? F : E;
+				d1[0] = (D == H) ? D : E;
+				d1[1] = (H == F) ? F : E;
+			} else {
+				d0[0] = d0[1] = d1[0] = d1[1] = E;
+			}
+			d0 += 2;
+			d1 += 2;
+		}
+	}
+}
+
+static void scale3x_rows(const int y0, const int y1) {
+	const Uint32 *above, *row, *below;
+	Uint32 *d0, *d1, *d2;
+	Uint32 A, B, C, D, E, F, G, H, I;
+	int x, y, xl, xr;
+	for (y = y0; y < y1; y++) {
+		above = src_row(y - 1);
+		row = src_row(y);
+		below = src_row(y + 1);
+		d0 = pass.dest + (pass.dest_pitch * y * 3);
+		d1 = d0 + pass.dest_pitch;
+		d2 = d1 + pass.dest_pitch;
+		for (x = 0; x < pass.w; x++) {
+			xl = (x > 0) ? x - 1 : 0;
+			xr = (x < pass.w - 1) ? x + 1 : x;
+			A = above[xl]; B = above[x]; C = above[xr];
+			D = row[xl]; E = row[x]; F = row[xr];
+			G = below[xl]; H = below[x]; I = below[xr];
+			if ((B != H) && (D != F)) {
+				d0[0] = (D == B) ? D : E;
+				d0[1] = (((D == B) && (E != C)) || ((B == F) && (E != A))) ? B : E;
+				d0[2] = (B == F) ? F : E;
+				d1[0] = (((D == B) && (E != G)) || ((D == H) && (E != A))) ? D : E;
+				d1[1] = E;
+				d1[2] = (((B == F) && (E != I)) || ((H == F) && (E != C))) ? F : E;
+				d2[0] = (D == H) ? D : E;
+				d2[1] = (((D == H) && (E != I)) || ((H == F) && (E != G))) ? H : E;
+				d2[2] = (H == F) ? F : E;
+			} else {
+				d0[0] = d0[1] = d0[2] = E;
+				d1[0] = d1[1] = d1[2] = E;
+				d2[0] = d2[1] = d2[2] = E;
+			}
+			d0 += 3;
+			d1 += 3;
+			d2 += 3;
+		}
+	}
+}
+
+/* whether two yuv colours are far enough apart to be different, using the
+ * hqx thresholds */
+static inline int is_yuv_diff(const uint32_t a, const uint32_t b) {
+	return (abs((int)(a >> 16) - (int)(b >> 16)) > 48)
+			|| (abs((int)((a >> 8) & 0xFF) - (int)((b >> 8) & 0xFF)) > 7)
+			|| (abs((int)(a & 0xFF) - (int)(b & 0xFF)) > 6);
+}
+
+static void lut_init(void) {
+	int i, k, solid;
+	Byte modes[4];
+	for (i = 0; i < (1 << 12); i++) {
+		solid = 0;
+		for (k = 0; k < 4; k++) {
+			modes[k] = LUT_NONE;
+			if ((i & lut_corners[k][0]) && (i & lut_corners[k][1])) {
+				if (!((i >> (8 + k)) & 0x01))
+					modes[k] = LUT_BOTH;
+				else if (i & lut_corners[k][2])
+					modes[k] = LUT_EDGE_SOLID;
+				else
+					modes[k] = LUT_EDGE;
+			}
+			solid += modes[k] == LUT_EDGE_SOLID;
+		}
+		lut_table[0][i] = lut_table[1][i] = 0;
+		for (k = 0; k < 4; k++) {
+			lut_table[1][i] |= modes[k] << (k * 2);
+			/* at 2x, cutting three or four corners would leave nothing
+			 * of a lone pixel */
+			if ((solid >= 3) && (modes[k] == LUT_EDGE_SOLID))
+				modes[k] = LUT_EDGE;
+			lut_table[0][i] |= modes[k] << (k * 2);
+		}
+	}
+}
+
+/* fills w with the 3x3 neighbourhood of (x, y), top left first, and
+ * returns its lut_table index */
+static inline unsigned int lut_pattern(const int x, const int y, Uint32 *w) {
+	static const Byte bits[9] = { 0x01, 0x02, 0x04, 0x08, 0, 0x10, 0x20, 0x40, 0x80 };
+	const uint32_t *yuv_row;
+	unsigned int pattern = 0;
+	uint32_t v[9];
+	int dx, dy, xx, yy, i;
+	for (dy = -1, i = 0; dy <= 1; dy++) {
+		yy = (y + dy < 0) ? 0 : (y + dy >= pass.h) ? pass.h - 1 : y + dy;
+		yuv_row = yuv + (yy * pass.w);
+		for (dx = -1; dx <= 1; dx++, i++) {
+			xx = (x + dx < 0) ? 0 : (x + dx >= pass.w) ? pass.w - 1 : x + dx;
+			w[i] = pass.src[(pass.src_pitch * yy) + xx];
+			v[i] = yuv_row[xx];
+		}
+	}
+	for (i = 0; i < 9; i++) {
+		if ((w[i] != w[4]) && is_yuv_diff(v[i], v[4]))
+			pattern |= bits[i];
+	}
+	if (pattern == 0)
+		return 0;
+	/* are the edge neighbours at each corner alike? */
+	pattern |= !is_yuv_diff(v[1], v[3]) << 8;
+	pattern |= !is_yuv_diff(v[1], v[5]) << 9;
+	pattern |= !is_yuv_diff(v[5], v[7]) << 10;
+	pattern |= !is_yuv_diff(v[7], v[3]) << 11;
+	return pattern;
+}
+
+/* the neighbours of each corner in lut_pattern()'s w: first edge, second
+ * edge, diagonal */
+static const Byte lut_neighbours[4][3] = {
+	{ 3, 1, 0 }, { 1, 5, 2 }, { 5, 7, 8 }, { 7, 3, 6 }
+};
+
+static void lut2x_rows(const int y0, const int y1) {
+	static const Byte offsets[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+	const Byte *n;
+	unsigned int modes;
+	Uint32 w[9];
+	Uint32 *d;
+	int x, y, k;
+	for (y = y0; y < y1; y++) {
+		d = pass.dest + (pass.dest_pitch * y * 2);
+		for (x = 0; x < pass.w; x++, d += 2) {
+			modes = lut_table[0][lut_pattern(x, y, w)];
+			if (modes == 0) {
+				d[0] = d[1] = d[pass.dest_pitch] = d[pass.dest_pitch + 1] = w[4];
+				continue;
+			}
+			for (k = 0; k < 4; k++) {
+				n = lut_neighbours[k];
+				d[(pass.dest_pitch * offsets[k][1]) + offsets[k][0]] = blend(w[4], w[n[0]], w[n[1]], w[n[2]],
+						lut_weights[(modes >> (k * 2)) & 0x03][0]);
+			}
+		}
+	}
+}
+
+static void lut4x_rows(const int y0, const int y1) {
+	/* the corner, first edge, second edge and inner pixels of each
+	 * corner, as x, y within the 4x4 block */
+	static const Byte offsets[4][4][2] = {
+		{ { 0, 0 }, { 0, 1 }, { 1, 0 }, { 1, 1 } },
+		{ { 3, 0 }, { 2, 0 }, { 3, 1 }, { 2, 1 } },
+		{ { 3, 3 }, { 3, 2 }, { 2, 3 }, { 2, 2 } },
+		{ { 0, 3 }, { 1, 3 }, { 0, 2 }, { 1, 2 } }
+	};
+	const Byte *n;
+	const Byte (*weights)[4];
+	unsigned int modes;
+	Uint32 w[9];
+	Uint32 *d, *r;
+	int x, y, k, i;
+	for (y = y0; y < y1; y++) {
+		d = pass.dest + (pass.dest_pitch * y * 4);
+		for (x = 0; x < pass.w; x++, d += 4) {
+			modes = lut_table[1][lut_pattern(x, y, w)];
+			if (modes == 0) {
+				for (i = 0, r = d; i < 4; i++, r += pass.dest_pitch)
+					r[0] = r[1] = r[2] = r[3] = w[4];
+				continue;
+			}
+			for (k = 0; k < 4; k++) {
+				n = lut_neighbours[k];
+				weights = lut_weights[(modes >> (k * 2)) & 0x03];
+				for (i = 0; i < 4; i++)
+					d[(pass.dest_pitch * offsets[k][i][1]) + offsets[k][i][0]] =
+							blend(w[4], w[n[0]], w[n[1]], w[n[2]], weights[i]);
+			}
+		}
+	}
+}
+
+/* the xbr colour distance, weighting luma most */
+static inline int yuv_dist(const uint32_t a, const uint32_t b) {
+	return 48 * abs((int)(a >> 16) - (int)(b >> 16))
+			+ 7 * abs((int)((a >> 8) & 0xFF) - (int)((b >> 8) & 0xFF))
+			+ 6 * abs((int)(a & 0xFF) - (int)(b & 0xFF));
+}
+
+/* level 1 2xbr for the bottom right corner of the centre of a 5x5
+ * neighbourhood, reached through the rotation 'rot'. returns the corner
+ * pixel: the centre, or the centre blended with the neighbour across an
+ * edge which runs through the corner */
+static inline Uint32 xbr_corner(const Uint32 *p, const uint32_t *v, const Byte *rot) {
+	/* the neighbourhood, as positions in a 5x5 block */
+	enum {
+		B = 7, C = 8, D = 11, E = 12, F = 13, F4 = 14,
+		G = 16, H = 17, I = 18, I4 = 19, H5 = 22, I5 = 23
+	};
+	static const Byte half[4] = { 4, 4, 0, 0 };
+	int e, i;
+	if ((p[rot[E]] == p[rot[F]]) || (p[rot[E]] == p[rot[H]]))
+		return p[rot[E]];
+	e = yuv_dist(v[rot[E]], v[rot[C]]) + yuv_dist(v[rot[E]], v[rot[G]])
+			+ yuv_dist(v[rot[I]], v[rot[F4]]) + yuv_dist(v[rot[I]], v[rot[H5]])
+			+ 4 * yuv_dist(v[rot[H]], v[rot[F]]);
+	i = yuv_dist(v[rot[H]], v[rot[D]]) + yuv_dist(v[rot[H]], v[rot[I5]])
+			+ yuv_dist(v[rot[F]], v[rot[I4]]) + yuv_dist(v[rot[F]], v[rot[B]])
+			+ 4 * yuv_dist(v[rot[E]], v[rot[I]]);
+	if (e >= i)
+		return p[rot[E]];
+	if (yuv_dist(v[rot[E]], v[rot[F]]) <= yuv_dist(v[rot[E]], v[rot[H]]))
+		return blend(p[rot[E]], p[rot[F]], 0, 0, half);
+	return blend(p[rot[E]], p[rot[H]], 0, 0, half);
+}
+
+static void xbr_rows(const int y0, const int y1) {
+	static const Byte offsets[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+	Uint32 p[25];
+	uint32_t v[25];
+	const Uint32 *row;
+	Uint32 *d;
+	int x, y, dx, dy, xx, yy, i, k;
+	for (y = y0; y < y1; y++) {
+		d = pass.dest + (pass.dest_pitch * y * 2);
+		for (x = 0; x < pass.w; x++, d += 2) {
+			row = src_row(y);
+			/* flat areas have nothing to blend */
+			if ((row[x] == src_row(y - 1)[x]) && (row[x] == src_row(y + 1)[x])
+					&& (row[x] == row[(x > 0) ? x - 1 : 0])
+					&& (row[x] == row[(x < pass.w - 1) ? x + 1 : x])) {
+				d[0] = d[1] = d[pass.dest_pitch] = d[pass.dest_pitch + 1] = row[x];
+				continue;
+			}
+			for (dy = -2, i = 0; dy <= 2; dy++) {
+				yy = (y + dy < 0) ? 0 : (y + dy >= pass.h) ? pass.h - 1 : y + dy;
+				for (dx = -2; dx <= 2; dx++, i++) {
+					xx = (x + dx < 0) ? 0 : (x + dx >= pass.w) ? pass.w - 1 : x + dx;
+					p[i] = pass.src[(pass.src_pitch * yy) + xx];
+					v[i] = yuv[(yy * pass.w) + xx];
+				}
+			}
+			for (k = 0; k < 4; k++)
+				d[(pass.dest_pitch * offsets[k][1]) + offsets[k][0]] = xbr_corner(p, v, xbr_rot[k]);
+		}
+	}
+}
@@ -0,0 +1,55 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of jonny nor the name of any other
+ *    contributor may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY jonny AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL jonny OR ANY OTHER
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, 
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+ 
+#ifndef _FILTER_H
+#define _FILTER_H
+
+#include <SDL/SDL.h>
+#include "gbem.h"
+
+/* pixel art filters, applied when a frame is scaled up to the screen */
+enum {
+	FILTER_NONE,
+	FILTER_SCALE2X,
+	FILTER_SCALE3X,
+	FILTER_SCALE4X,
+	FILTER_LUT2X,
+	FILTER_LUT4X,
+	FILTER_XBR,
+	FILTER_COUNT
+};
+
+void filter_init(void);
+void filter_fini(void);
+void filter_frame(SDL_Surface *src, SDL_Surface *dest);
+void filter_frame_rows(SDL_Surface *src, SDL_Surface *dest, int y0, int y1, SDL_Rect *rect);
+void filter_set(unsigned int filter);
+unsigned int filter_get(void);
+const char *filter_name(unsigned int filter);
+void filter_set_threads(unsigned int count);
+void filter_benchmark(SDL_Surface *frame);
+
+#endif /* _FILTER_H */
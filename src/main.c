@@ -31,6 +31,8 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <signal.h>
 
 #include <SDL/SDL.h>
 #include <locale.h>
@@ -50,39 +52,90 @@
 #include "sound.h"
 #include "debug.h"
 #include "save.h"
+#include "stats.h"
+#include "scale.h"
+#include "filter.h"
+#include "video.h"
+#include "capture.h"
+#include "tileview.h"
 
 #define TIMING_GRANULARITY	10000
 #define TIMING_INTERVAL		(1000000000 / TIMING_GRANULARITY)
-#define MAX_CPU_CYCLES		200
+/* master clock ticks the cpu runs between host sync points, where input is
+ * polled and the speed is paced. the audio device catches up by itself */
+#define MAX_CPU_CYCLES		400
+/* how often the achieved speed is checked, in ms */
+#define SPEED_LOG_INTERVAL	1000
+
+/* emulation speeds, in percent, stepped through with - and =.
+ * 0 runs as fast as possible */
+static const unsigned int speeds[] = {25, 50, 100, 200, 400, 0};
+#define SPEED_NORMAL		2
+#define SPEED_COUNT			(sizeof(speeds) / sizeof(speeds[0]))
 
 int console;
 int console_mode;
 
 extern CoreState core;
+extern Display display;
 
 void reset(void);
 void quit(void);
+static void set_speed(unsigned int index, int keep_pitch);
+static int is_slow(unsigned int index);
+static void log_speed(unsigned int requested);
+static void run_slices(uint64_t host_sync);
+static int poll_event(SDL_Event *event);
+static void on_signal(int sig);
 extern int debugging;
-extern int sound_cycles;
 
+static Histogram slice_histogram = { "cpu slice lengths (ticks)", 16 };
+
+/* without a window there are no quit events: signals stand in for them */
+static volatile sig_atomic_t is_quit_signalled = 0;
 
 
 int main(int argc, char *argv[]) {
-	int i;
 	unsigned int is_paused, is_sound_on;
-	unsigned int cycles;
-	unsigned int core_period;
 	SDL_Event event;
-	unsigned int core_time;
+	uint64_t core_start;
+	uint64_t core_time;
 	unsigned int delay;
 	int is_delayed;
-	unsigned int real_time;
-	unsigned int real_time_passed;
+	uint64_t real_time;
+	uint64_t real_time_passed;
 	unsigned int delays;
-	unsigned int frame_time;
 	int is_turbo = 0;
+	unsigned int speed_index = SPEED_NORMAL;
+	unsigned int speed;
+	int keep_pitch = 0;
+	const char *capture_path = NULL;
+	const char *tiles_path = NULL;
+	int ppu = PPU_LINE;
+	int rtc_mode = -1;
+	SDL_Surface *frame;
 
 	printf("%s v%s\n", PACKAGE_NAME, PACKAGE_VERSION);
+	/* gbem [-video sdl|headless] [-capture file.y4m|file.rgb]
+	 *      [-tiles file.ppm] [-ppu line|fifo] [-rtc virtual|wall] rom */
+	while ((argc > 3) && (argv[1][0] == '-')) {
+		if ((strcmp(argv[1], "-video") == 0) && (video_find(argv[2]) >= 0))
+			video_set(video_find(argv[2]));
+		else if (strcmp(argv[1], "-capture") == 0)
+			capture_path = argv[2];
+		else if (strcmp(argv[1], "-tiles") == 0)
+			tiles_path = argv[2];
+		else if ((strcmp(argv[1], "-ppu") == 0) && (display_find_ppu(argv[2]) >= 0))
+			ppu = display_find_ppu(argv[2]);
+		else if ((strcmp(argv[1], "-rtc") == 0) && (strcmp(argv[2], "virtual") == 0))
+			rtc_mode = 0;
+		else if ((strcmp(argv[1], "-rtc") == 0) && (strcmp(argv[2], "wall") == 0))
+			rtc_mode = 1;
+		else
+			break;
+		argv += 2;
+		argc -= 2;
+	}
 	if (argc != 2) {
 		printf("Invalid arguments\n");
 		return 1;
@@ -99,7 +152,8 @@ int main(int argc, char *argv[]) {
 	}
 #endif
 
-	if(SDL_Init(SDL_INIT_VIDEO) < 0) {
+	/* the video backend brings up sdl video if it needs it */
+	if(SDL_Init(0) < 0) {
 		fprintf(stderr,"sdl initialisation failed: %s\b", SDL_GetError());
 		exit(1);
 	}
@@ -108,45 +162,55 @@ int main(int argc, char *argv[]) {
 	console = CONSOLE_AUTO;
 	//console = CONSOLE_DMG;
 	//console_mode = MODE_DMG;
+	/* with a virtual clock, the mbc3 clock doesn't catch up with the time
+	 * since the sram was saved, so runs are reproducible. headless and
+	 * captured runs are batch runs, and default to it */
+	if (rtc_mode < 0)
+		rtc_mode = (video_get() != VIDEO_HEADLESS) && (capture_path == NULL);
+	rtc_catch_up = rtc_mode;
 	load_rom(argv[1]);
 	display_init();
 	joypad_init();
-	sound_init();
+	/* a headless run needs no sound device, and may be one of many */
+	sound_init(video_get() != VIDEO_HEADLESS);
 	debug_init();
 	reset();
 	is_paused = 0;
 	is_sound_on = 1;
-	cycles = 0;
+	core_start = core.clock;
 	core_time = 0;
 	delay = 1;
 	is_delayed = 0;
-	real_time = SDL_GetTicks() * 1000000;
+	real_time = SDL_GetTicks() * (uint64_t)1000000;
 	delays = 0;
-	frame_time = SDL_GetTicks();
-	// main loop
-	// TODO intelligent algorithm for working out number of cycles to execute
-	// based on interrupt predictions...
+	speed = speeds[speed_index];
+	stats_register_histogram(&slice_histogram);
+	if (capture_path != NULL)
+		capture_start(capture_path);
+	if (tiles_path != NULL)
+		tileview_start(tiles_path);
+	display_set_ppu(ppu);
+	if (video_get() == VIDEO_HEADLESS) {
+		signal(SIGINT, on_signal);
+		signal(SIGTERM, on_signal);
+	}
 	
 	while(1) {
-		if ((!is_paused) && (!is_delayed)) {
-			for (i = 0; i < 10; i++) {
-				cycles = execute_cycles(40);
-
-				core_period = (cycles >> 2) * (1000000000/(1048576));
-				core_time += core_period;
-				timer_check(cycles * core.frequency);
-				display_update(cycles);
-				sound_update();
-			}
-		}
+		if ((!is_paused) && (!is_delayed))
+			run_slices(core.clock + MAX_CPU_CYCLES);
 		
 		if (is_paused) 
 			SDL_Delay(10);
 
+		/* emulated time passed since the last timing reset, in ns, scaled
+		 * to the real time it should take at the chosen speed */
+		core_time = ((core.clock - core_start) * 1000000000) / MASTER_CLOCK_HZ;
+		if (speed != 0)
+			core_time = core_time * 100 / speed;
 		delays = core_time / TIMING_INTERVAL;
 		if (delays > delay) {
-			real_time_passed = ((SDL_GetTicks() * 1000000) - real_time);
-			if ((core_time > real_time_passed) && (!is_turbo)) {
+			real_time_passed = ((SDL_GetTicks() * (uint64_t)1000000) - real_time);
+			if ((core_time > real_time_passed) && (!is_turbo) && (speed != 0)) {
 				if (core_time > real_time_passed + (2 * 1000000))
 					SDL_Delay(1);
 				is_delayed = 1;
@@ -156,18 +220,85 @@ int main(int argc, char *argv[]) {
 			}
 			if (delay >= TIMING_GRANULARITY) {
 				delay = 1;
-				core_time = 0;
-				real_time = SDL_GetTicks() * 1000000;
+				core_start = core.clock;
+				real_time = SDL_GetTicks() * (uint64_t)1000000;
 			}
 		}
+		if (!is_paused)
+			log_speed(is_turbo ? 0 : speed);
 
-		while (SDL_PollEvent(&event)) {
+		if (is_quit_signalled) {
+			quit();
+			exit(0);
+		}
+		while (poll_event(&event)) {
 			switch (event.type) {
 				case SDL_QUIT:
 					quit();
 					exit(0);
 					break;
 				case SDL_KEYDOWN:
+					if ((event.key.keysym.sym == SDLK_MINUS) ||
+							(event.key.keysym.sym == SDLK_EQUALS) ||
+							(event.key.keysym.sym == SDLK_k)) {
+						if ((event.key.keysym.sym == SDLK_MINUS) && (speed_index > 0))
+							--speed_index;
+						if ((event.key.keysym.sym == SDLK_EQUALS) && (speed_index < SPEED_COUNT - 1))
+							++speed_index;
+						/* the pitch can't be kept slower than normal */
+						if ((event.key.keysym.sym == SDLK_k) && is_slow(speed_index))
+							printf("pitch can only be kept at 100%% or faster\n");
+						else if (event.key.keysym.sym == SDLK_k)
+							keep_pitch = !keep_pitch;
+						if (is_slow(speed_index))
+							keep_pitch = 0;
+						set_speed(speed_index, keep_pitch);
+						speed = speeds[speed_index];
+						/* pace the new speed from here on */
+						core_start = core.clock;
+						real_time = SDL_GetTicks() * (uint64_t)1000000;
+						delay = 1;
+						is_delayed = 0;
+					}
+					if (event.key.keysym.sym == SDLK_f) {
+						display_set_deferred(!display.is_deferred);
+						printf("renderer: %s\n", display.is_deferred ? "frame" : "scan line");
+					}
+					if (event.key.keysym.sym == SDLK_v) {
+						display_set_ppu(display_get_ppu() + 1);
+						printf("ppu: %s\n", display_ppu_name(display_get_ppu()));
+					}
+					if (event.key.keysym.sym == SDLK_m) {
+						/* 1, 2, 4, 8 and round again */
+						unsigned int threads = display_get_raster_threads();
+						display_set_raster_threads(threads >= 8 ? 1 : threads * 2);
+						display_lock_video();
+						filter_set_threads(display_get_raster_threads());
+						display_unlock_video();
+						printf("raster and filter threads: %u\n", display_get_raster_threads());
+					}
+					if (event.key.keysym.sym == SDLK_b) {
+						display_benchmark();
+						scale_benchmark();
+						frame = display_create_surface();
+						display_resolve(display.frame, frame);
+						display_lock_video();
+						filter_benchmark(frame);
+						display_unlock_video();
+						SDL_FreeSurface(frame);
+					}
+					if (event.key.keysym.sym == SDLK_c) {
+						display_set_colour_profile(display_get_colour_profile() + 1);
+						printf("colour correction: %s\n", display_colour_profile_name(display_get_colour_profile()));
+					}
+					if (event.key.keysym.sym == SDLK_g) {
+						filter_set(filter_get() + 1);
+						printf("filter: %s\n", filter_name(filter_get()));
+					}
+					if (event.key.keysym.sym == SDLK_t) {
+						display_set_threaded(!display_is_threaded());
+						printf("render thread: %s\n", display_is_threaded() ? "on" : "off");
+					}
 					if (event.key.keysym.sym == SDLK_d) {
 						printf("d\n");
 						debugging = !debugging;
@@ -189,12 +320,19 @@ int main(int argc, char *argv[]) {
 					if (event.key.keysym.sym == SDLK_r) {
 						printf("reset\n");
 						reset();
+						/* the master clock has moved: restart the timing */
+						core_start = core.clock;
+						real_time = SDL_GetTicks() * (uint64_t)1000000;
+						delay = 1;
 					}
 					if (event.key.keysym.sym == SDLK_F1) {
 						save_state();
 					}
 					if (event.key.keysym.sym == SDLK_F2) {
 						load_state();
+						core_start = core.clock;
+						real_time = SDL_GetTicks() * (uint64_t)1000000;
+						delay = 1;
 					}
 					if(event.key.keysym.sym == SDLK_ESCAPE) {
 						quit();
@@ -230,15 +368,103 @@ void reset(void) {
 	sound_reset();
 }
 
+/* runs the cpu up to the master clock time host_sync. each slice ends where
+ * the lcd or timer could next raise an interrupt, so they only need to be
+ * brought up to date in between. a register write which moves the next
+ * event ends the slice early. the serial port completes transfers as soon
+ * as they are started, so it never needs a slice of its own. */
+static void run_slices(uint64_t host_sync) {
+	unsigned int slice, next;
+	while (core.clock < host_sync) {
+		slice = (unsigned int)(host_sync - core.clock);
+		next = display_next_event();
+		if (next < slice)
+			slice = next;
+		next = timer_next_event();
+		if (next < slice)
+			slice = next;
+		histogram_add(&slice_histogram, slice);
+		execute_cycles(slice * core.frequency);
+		timer_sync();
+		display_sync();
+	}
+}
+
+/* polls for an event, unless the render thread is busy presenting a frame:
+ * the input will be picked up next time round */
+static int poll_event(SDL_Event *event) {
+	int is_event;
+	if (!display_try_lock_video())
+		return 0;
+	is_event = SDL_PollEvent(event);
+	display_unlock_video();
+	return is_event;
+}
+
+static void on_signal(int sig) {
+	is_quit_signalled = 1;
+}
+
+/* switches to speeds[index], resampling the sound to match */
+static void set_speed(unsigned int index, int keep_pitch) {
+	sound_set_speed(speeds[index], keep_pitch);
+	if (speeds[index] == 0)
+		printf("speed: max%s\n", keep_pitch ? ", pitch kept" : "");
+	else
+		printf("speed: %u%%%s\n", speeds[index], keep_pitch ? ", pitch kept" : "");
+}
+
+/* whether speeds[index] is slower than normal */
+static int is_slow(unsigned int index) {
+	return (speeds[index] != 0) && (speeds[index] < 100);
+}
+
+/* compares the emulated time with the real time every SPEED_LOG_INTERVAL,
+ * and reports the achieved speed when it is not the normal one or falls
+ * short of the requested speed (in percent, 0 is unlimited) */
+static void log_speed(unsigned int requested) {
+	static uint64_t last_clock;
+	static Uint32 last_ticks;
+	Uint32 ticks = SDL_GetTicks();
+	uint64_t emulated_ms;
+	unsigned int achieved;
+
+	/* a reset or state load moves the clock */
+	if (core.clock < last_clock) {
+		last_clock = core.clock;
+		last_ticks = ticks;
+		return;
+	}
+	if (ticks - last_ticks < SPEED_LOG_INTERVAL)
+		return;
+	emulated_ms = ((core.clock - last_clock) * 1000) / MASTER_CLOCK_HZ;
+	achieved = (unsigned int)((emulated_ms * 100) / (ticks - last_ticks));
+	if (requested == 0)
+		printf("speed: max requested, %u%% achieved\n", achieved);
+	else if ((requested != 100) || (achieved < requested * 95 / 100))
+		printf("speed: %u%% requested, %u%% achieved\n", requested, achieved);
+	last_clock = core.clock;
+	last_ticks = ticks;
+}
+
 void quit(void) {
 	sound_fini();
+	capture_stop();
+	tileview_stop();
 	unload_rom();
 	display_fini();
+	/* after the audio and render threads have stopped */
+	stats_report();
 	memory_fini();
 	SDL_Quit();
 }
 
+/* called by the display at the end of every frame */
 void new_frame(void) {
+	/* the sound is only synced when touched: make sure that happens at
+	 * least once per frame */
+	sound_sync();
+	stats_frame();
 #if 0
 	const unsigned fps = 60;		/* 59.72 but meh */
 	const unsigned frame_us = (1000000 / fps);
@@ -33,6 +33,7 @@
 #include "display.h"
 #include "joypad.h"
 #include "sound.h"
+#include "timer.h"
 #include "save.h"
 
 #define ADDRESS_SPACE		0x10000
@@ -145,8 +146,10 @@ void writeb(Word address, Byte value) {
 		switch (address) {
 			case HWREG_STAT:
 			/* the bottom 3 bits of STAT are read only.	*/
+				display_sync();
 				himem[address - MEM_IO] = (himem[address - MEM_IO] & 0x07) 
                 	| (value & 0xF8);
+				end_slice();
 				return;
 				break;
 			case HWREG_LCDC:
@@ -162,7 +165,33 @@ void writeb(Word address, Byte value) {
 				break;
 			case HWREG_DIV:
 				// If DIV is written to, it is set to 0.
+				timer_sync();
 				himem[address - MEM_IO] = 0;
+				end_slice();
+				break;
+			case HWREG_TIMA:
+			case HWREG_TMA:
+			case HWREG_TAC:
+				/* bring the timer up to date before it is changed */
+				timer_sync();
+				himem[address - MEM_IO] = value;
+				end_slice();
+				break;
+			case HWREG_LYC:
+				display_sync();
+				himem[address - MEM_IO] = value;
+				end_slice();
+				break;
+			case HWREG_SCY:
+			case HWREG_SCX:
+			case HWREG_WY:
+			case HWREG_WX:
+			case HWREG_BGP:
+			case HWREG_OBP0:
+			case HWREG_OBP1:
+				/* the fifo ppu draws up to here with the old value */
+				display_ppu_sync();
+				himem[address - MEM_IO] = value;
 				break;
 			default:
 				himem[address - MEM_IO] = value;
@@ -29,6 +29,8 @@
 
 #include <stdio.h>
 #include "gbem.h"
+#include "sound.h"
+#include "timer.h"
 
 #define VT_GRANULARITY 0x100
 
@@ -95,6 +97,16 @@ static inline Byte* get_vector(Word address) {
 
 static inline Byte readb(Word address) {
 	extern Byte** vector_table;
+	/* the sound is only brought up to date when it is touched, so the
+	 * channel status bits in NR52 must be refreshed before being read.
+	 * the timer is only synced between cpu slices, so likewise for DIV and
+	 * TIMA. */
+	if ((address >= HWREG_DIV) && (address <= HWREG_NR52)) {
+		if (address == HWREG_NR52)
+			sound_sync();
+		else if (address <= HWREG_TIMA)
+			timer_sync();
+	}
 	return *(vector_table[address >> 8] + (address & 0xFF));
 }
 
@@ -5,6 +5,9 @@
 #include <stdint.h>
 
 #include "gbem.h"
+#include "core.h"
+#include "save.h"
+#include "rtc.h"
 
 #define RTC_SUBTRACT_REG	0x08
 #define RTC_REG_S			0x00
@@ -13,44 +16,43 @@
 #define RTC_REG_DL			0x03
 #define RTC_REG_DH			0x04
 
-static void set_registers();
+// the clock crystal runs at 32768Hz, which divides the master clock exactly
+#define RTC_HZ				32768
+#define RTC_DIVIDER			(MASTER_CLOCK_HZ / RTC_HZ)
+
+// the counters overflow after 512 days
+#define RTC_PERIOD			(60 * 60 * 24 * 256 * 2)
+
+static void rtc_sync();
+static void add_seconds(uint64_t seconds);
+static uint64_t get_seconds();
+static void set_seconds(uint64_t seconds, int is_overflowed);
 static void byte_swap(Byte *ptr, size_t size);
 
+extern CoreState core;
+
 Byte regs[5];
 Byte regs_latched[5];
 
 int is_halted;
 
-time_t start_time = 0;
-time_t halt_time = 0;
+// whether the clock catches up with the time spent switched off, when the
+// sram file is loaded. without it, runs are reproducible.
+int rtc_catch_up = 1;
+
+// the clock is driven by the master clock: ticks of the 32768Hz crystal
+// into the current second, and the master clock time of the last sync
+static unsigned int sub_ticks;
+static uint64_t last_sync;
 
 void rtc_set_register(Byte r, Byte value) {
 	r -= RTC_SUBTRACT_REG;
-	set_registers();
+	rtc_sync();
 	regs[r] = value;
-
-	// has the timer just been halted?
-	if ((!is_halted) && (regs[RTC_REG_DH] & 0x40)) {
-		halt_time = time(NULL);
-	} else
-	// has the timer just been unhalted?
-	if ((is_halted) && !(regs[RTC_REG_DH] & 0x40)) {
-		time_t time_halted = time(NULL) - halt_time;
-		start_time += time_halted;
-	}
-	
+	// writing the seconds restarts the second
+	if (r == RTC_REG_S)
+		sub_ticks = 0;
 	is_halted = (regs[RTC_REG_DH] & 0x40);
-
-	// if the timer is active, save the time
-	if (!is_halted) {
-		start_time = time(NULL);
-		start_time -= regs[RTC_REG_S];
-		start_time -= regs[RTC_REG_M] * 60;
-		start_time -= regs[RTC_REG_H] * 60 * 60;
-		start_time -= regs[RTC_REG_DL] * 60 * 60 * 24;
-		start_time -= (regs[RTC_REG_DH] & 0x01) * 60 * 60 * 24 * 256;
-		start_time -= ((regs[RTC_REG_DH] & 0x80) >> 7) * 60 * 60 * 24 * 256 * 2;
-	}
 	//fprintf(stderr, "rtc_set_register: %hhx: %hhx\n", r, value);
 }
 
@@ -62,50 +64,86 @@ Byte rtc_get_register(Byte r) {
 
 void rtc_latch() {
 	//fprintf(stderr, "rtc latch\n");
-	set_registers();
+	rtc_sync();
 	for (int i = 0; i < 0x05; i++) {
 		regs_latched[i] = regs[i];
 	}
 }
 
-static void set_registers() {
-	time_t elapsed = time(NULL) - start_time;
-	if (is_halted) {
-		time_t time_halted = time(NULL) - halt_time;
-		elapsed -= time_halted;
-	}
-	if (elapsed < 0) {
-		fprintf(stderr, "real time clock error: clock was started in the future. Check system clock / time zone.\n");
-		elapsed = 0;
+// brings the counters up to date with the master clock
+static void rtc_sync() {
+	uint64_t now = core.clock / RTC_DIVIDER;
+	uint64_t ticks;
+	// a reset or state load can move the master clock backwards
+	if (now < last_sync) {
+		last_sync = now;
+		return;
 	}
-	regs[RTC_REG_S] = elapsed % 60;
-	regs[RTC_REG_M] = (elapsed % (60 * 60)) / 60;
-	regs[RTC_REG_H] = (elapsed % (60 * 60 * 24)) / (60 * 60);
-	regs[RTC_REG_DL] = (elapsed % (60 * 60 * 24 * 256)) / (60 * 60 * 24);
-	regs[RTC_REG_DH] = ((elapsed % (60 * 60 * 24 * 256 * 2)) / (60 * 60 * 24 * 256)) % 2;
-	// has the timer overflowed?
-	if ((elapsed / (60 * 60 * 24 * 256 * 2)))
+	ticks = now - last_sync;
+	last_sync = now;
+	if (is_halted)
+		return;
+	ticks += sub_ticks;
+	sub_ticks = ticks % RTC_HZ;
+	if (ticks >= RTC_HZ)
+		add_seconds(ticks / RTC_HZ);
+}
+
+static void add_seconds(uint64_t seconds) {
+	uint64_t total = get_seconds() + seconds;
+	// the overflow flag stays set until it is written
+	set_seconds(total % RTC_PERIOD, (regs[RTC_REG_DH] & 0x80) || (total >= RTC_PERIOD));
+}
+
+// returns the time in the counters, in seconds
+static uint64_t get_seconds() {
+	return regs[RTC_REG_S] + regs[RTC_REG_M] * 60 + regs[RTC_REG_H] * 60 * 60
+		+ (regs[RTC_REG_DL] + (regs[RTC_REG_DH] & 0x01) * 256) * (uint64_t)(60 * 60 * 24);
+}
+
+// sets the counters from a time in seconds, below RTC_PERIOD
+static void set_seconds(uint64_t seconds, int is_overflowed) {
+	regs[RTC_REG_S] = seconds % 60;
+	regs[RTC_REG_M] = (seconds % (60 * 60)) / 60;
+	regs[RTC_REG_H] = (seconds % (60 * 60 * 24)) / (60 * 60);
+	regs[RTC_REG_DL] = (seconds % (60 * 60 * 24 * 256)) / (60 * 60 * 24);
+	regs[RTC_REG_DH] = (seconds / (60 * 60 * 24 * 256)) & 0x01;
+	if (is_overflowed)
 		regs[RTC_REG_DH] |= 0x80;
-	regs[RTC_REG_DH] |= is_halted;
+	if (is_halted)
+		regs[RTC_REG_DH] |= 0x40;
 }
 
+// the wall clock times let the clock catch up with the time spent switched
+// off: the counters read start_time seconds when the file was saved at
+// save_time. files from before the clock was emulated end at halt_time.
 typedef struct {
 	uint64_t start_time;
 	uint32_t is_halted;
 	uint64_t halt_time;
+	uint64_t save_time;
+	uint32_t sub_ticks;
 } __attribute__ ((packed)) Rtc_save_block;
 
+#define RTC_OLD_BLOCK_SIZE	20
+
 void rtc_save_sram(FILE *fp) {
 	Rtc_save_block save_block;
-	save_block.start_time = start_time;
-	save_block.is_halted = is_halted;
-	save_block.halt_time = halt_time;
+	time_t now = time(NULL);
 	size_t c;
+	rtc_sync();
+	save_block.start_time = now - get_seconds() - ((regs[RTC_REG_DH] & 0x80) ? RTC_PERIOD : 0);
+	save_block.is_halted = is_halted;
+	save_block.halt_time = now;
+	save_block.save_time = now;
+	save_block.sub_ticks = sub_ticks;
 
 	#ifdef WORDS_BIGENDIAN
 	byte_swap((Byte *)&save_block.start_time, sizeof(save_block.start_time));
 	byte_swap((Byte *)&save_block.is_halted, sizeof(save_block.is_halted));
 	byte_swap((Byte *)&save_block.halt_time, sizeof(save_block.halt_time));
+	byte_swap((Byte *)&save_block.save_time, sizeof(save_block.save_time));
+	byte_swap((Byte *)&save_block.sub_ticks, sizeof(save_block.sub_ticks));
 	#endif
 	
 	c = fwrite(&save_block, sizeof(Byte), sizeof(save_block), fp);
@@ -119,9 +157,11 @@ void rtc_save_sram(FILE *fp) {
 void rtc_load_sram(FILE *fp) {
 	size_t c;
 	Rtc_save_block save_block;
+	uint64_t now;
+	int64_t elapsed;
 	
 	c = fread(&save_block, sizeof(Byte), sizeof(save_block), fp);
-	if (c != sizeof(save_block)) {
+	if (c < RTC_OLD_BLOCK_SIZE) {
 		fprintf(stderr, "error: read only %zu of %zu bytes of rtc from sram file\n", c, sizeof(save_block));
 		perror("fread");
 		return;
@@ -131,11 +171,29 @@ void rtc_load_sram(FILE *fp) {
 	byte_swap((Byte *)&save_block.start_time, sizeof(save_block.start_time));
 	byte_swap((Byte *)&save_block.is_halted, sizeof(save_block.is_halted));
 	byte_swap((Byte *)&save_block.halt_time, sizeof(save_block.halt_time));
+	byte_swap((Byte *)&save_block.save_time, sizeof(save_block.save_time));
+	byte_swap((Byte *)&save_block.sub_ticks, sizeof(save_block.sub_ticks));
 	#endif
 
-	start_time = save_block.start_time;
-	is_halted = save_block.is_halted;
-	halt_time = save_block.halt_time;
+	// an old file doesn't say when it was saved: it can only catch up
+	if (c < sizeof(save_block)) {
+		save_block.save_time = time(NULL);
+		save_block.sub_ticks = 0;
+	}
+	now = save_block.save_time;
+	if (rtc_catch_up)
+		now = time(NULL);
+	if (save_block.is_halted)
+		now = save_block.halt_time;
+	elapsed = now - save_block.start_time;
+	if (elapsed < 0) {
+		fprintf(stderr, "real time clock error: clock was started in the future. Check system clock / time zone.\n");
+		elapsed = 0;
+	}
+	is_halted = save_block.is_halted ? 0x40 : 0;
+	set_seconds(elapsed % RTC_PERIOD, elapsed >= RTC_PERIOD);
+	sub_ticks = save_block.sub_ticks % RTC_HZ;
+	last_sync = core.clock / RTC_DIVIDER;
 }
 
 void reset_rtc() {
@@ -144,8 +202,28 @@ void reset_rtc() {
 		regs_latched[i] = 0;
 	}
 	is_halted = 0;
-	start_time = time(NULL);
-	halt_time = 0;
+	sub_ticks = 0;
+	last_sync = core.clock / RTC_DIVIDER;
+}
+
+void rtc_save(void) {
+	rtc_sync();
+	save_memory("rtc_regs", regs, 5);
+	save_memory("rtc_regs_latched", regs_latched, 5);
+	save_uint("rtc_sub_ticks", sub_ticks);
+}
+
+void rtc_load(void) {
+	// older states have no clock: keep the one loaded from the sram
+	sub_ticks = 0;
+	if (load_exists("rtc_regs"))
+		load_memory("rtc_regs", regs, 5);
+	if (load_exists("rtc_regs_latched"))
+		load_memory("rtc_regs_latched", regs_latched, 5);
+	if (load_exists("rtc_sub_ticks"))
+		sub_ticks = load_uint("rtc_sub_ticks");
+	is_halted = (regs[RTC_REG_DH] & 0x40);
+	last_sync = core.clock / RTC_DIVIDER;
 }
 
 static void byte_swap(Byte *ptr, size_t size) {
@@ -156,4 +234,3 @@ static void byte_swap(Byte *ptr, size_t size) {
 		ptr[size - i - 1] = temp;
 	}
 }
-
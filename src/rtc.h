@@ -11,5 +11,9 @@ void rtc_save_sram(FILE *fp);
 void rtc_load_sram(FILE *fp);
 void reset_rtc();
 void rtc_latch();
+void rtc_save(void);
+void rtc_load(void);
+
+extern int rtc_catch_up;
 
 #endif
@@ -36,6 +36,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include "gbem.h"
 #include "save.h"
 #include "cart.h"
@@ -43,6 +44,7 @@
 #include "memory.h"
 #include "sound.h"
 #include "display.h"
+#include "timer.h"
 
 #define NO_MATCH	-1
 
@@ -82,6 +84,7 @@ void save_state(void) {
 	memory_save();
 	cart_save();
 	display_save();
+	timer_save();
 	sound_save();
 	
 	fclose(fp);
@@ -139,6 +142,7 @@ void load_state(void) {
 	memory_load();
 	cart_load();
 	display_load();
+	timer_load();
 	sound_load();
 	
 	for (i = 0; i < entries; i++) {
@@ -182,6 +186,12 @@ void save_uint(char* key, unsigned int i) {
 	fprintf(fp, "%s=%u\n", key, i);
 }
 
+void save_uint64(char* key, uint64_t i) {
+	assert(fp != NULL);
+	if (err) return;
+	fprintf(fp, "%s=%" PRIu64 "\n", key, i);
+}
+
 void save_byte(char* key, Byte i) {
 	assert(fp != NULL);
 	if (err) return;
@@ -226,6 +236,18 @@ unsigned int load_uint(char* key) {
 	return v;
 }
 
+uint64_t load_uint64(char* key) {
+	int i;
+	uint64_t v;
+	assert(fp != NULL);
+	i = get_index(key);
+	if (sscanf(values[i], "%" SCNu64, &v) != 1) {
+		fprintf(stderr, "not uint64 in key: \"%s\"\n value: \"%s\"\n", key, values[i]);
+		exit(1);
+	}
+	return v;
+}
+
 int load_int(char* key) {
 	int i;
 	int v;
@@ -265,6 +287,18 @@ Word load_word(char* key) {
 
 
 
+/* whether the state file has key. states saved by older versions lack
+ * the newer keys, which the loaders can then leave at a default */
+int load_exists(char* key) {
+	int i;
+	assert(fp != NULL);
+	for (i = 0; i < entries; i++) {
+		if (!strcmp(keys[i], key))
+			return 1;
+	}
+	return 0;
+}
+
 static int get_index(char* key) {
 	int i;
 	for (i = 0; i < entries; i++) {
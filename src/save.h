@@ -36,13 +36,16 @@ void save_memory(char* key, Byte* mem, unsigned int count);
 void save_string(char* key, char* s);
 void save_int(char* key, int i);
 void save_uint(char* key, unsigned int i);
+void save_uint64(char* key, uint64_t i);
 void save_byte(char* key, Byte i);
 void save_word(char* key, Word i);
 void save_float(char* key, float f);
 
+int load_exists(char* key);
 void load_memory(char* key, Byte* mem, unsigned int count);
 char* load_string(char* key);
 unsigned int load_uint(char* key);
+uint64_t load_uint64(char* key);
 int load_int(char* key);
 Byte load_byte(char* key);
 Word load_word(char* key);
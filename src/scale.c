@@ -27,150 +27,290 @@
 #include <SDL/SDL.h>
 #include <assert.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include "scale.h"
- 
-static inline Uint32 get_pixel(const SDL_Surface *surface, const int x, 
-			const int y);
-static inline void put_pixel(const SDL_Surface *surface, const int x, const int y, 
-                        const Uint32 pixel);
+#include "stats.h"
+
+/* the simd row wideners are compiled for their instruction sets whatever
+ * -march says, and picked at run time by scale_init() */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCALE_X86
+#include <immintrin.h>
+#endif
+
+#define BENCHMARK_FRAMES	200
+
+/* writes w source pixels, each repeated 'factor' times, to dest */
+typedef void (*Widen)(const Uint32 * restrict src, Uint32 * restrict dest, int w);
+
+static void widen2_c(const Uint32 * restrict src, Uint32 * restrict dest, int w);
+static void widen3_c(const Uint32 * restrict src, Uint32 * restrict dest, int w);
+static void widen4_c(const Uint32 * restrict src, Uint32 * restrict dest, int w);
+static void scale_rows(SDL_Surface* restrict src, SDL_Surface* restrict dest,
+			const int factor, const Widen widen, int y0, int y1);
+
+typedef struct {
+	const char *name;
+	Widen widen[5];		/* indexed by the scale factor */
+} ScaleImpl;
+
+static const ScaleImpl scalar_impl = {
+	"scalar", { NULL, NULL, widen2_c, widen3_c, widen4_c }
+};
+
+#ifdef SCALE_X86
+static void widen2_sse2(const Uint32 * restrict src, Uint32 * restrict dest, int w);
+static void widen3_sse2(const Uint32 * restrict src, Uint32 * restrict dest, int w);
+static void widen4_sse2(const Uint32 * restrict src, Uint32 * restrict dest, int w);
+static void widen2_avx2(const Uint32 * restrict src, Uint32 * restrict dest, int w);
+static void widen3_avx2(const Uint32 * restrict src, Uint32 * restrict dest, int w);
+static void widen4_avx2(const Uint32 * restrict src, Uint32 * restrict dest, int w);
+
+static const ScaleImpl sse2_impl = {
+	"sse2", { NULL, NULL, widen2_sse2, widen3_sse2, widen4_sse2 }
+};
+static const ScaleImpl avx2_impl = {
+	"avx2", { NULL, NULL, widen2_avx2, widen3_avx2, widen4_avx2 }
+};
+#endif
+
+static const ScaleImpl *impl = &scalar_impl;
 
 /* adjust as necessary ! */
 const unsigned int bpp = 4;
 
+/* picks the fastest row wideners the cpu supports */
+void scale_init(void) {
+#ifdef SCALE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = &avx2_impl;
+	else if (__builtin_cpu_supports("sse2"))
+		impl = &sse2_impl;
+#endif
+	printf("scaler: %s\n", impl->name);
+}
+
+/* nearest neighbour scaling to any size. source columns are stepped in
+ * 16.16 fixed point, and a destination row which comes from the same
+ * source row as the one above it is copied */
 void scale_nn(SDL_Surface* restrict src, SDL_Surface* restrict dest) {
-	int px, py, y, x;
-	int pixel;
-	for (y = 0; y < dest->h; y++) {
-		for (x = 0; x < dest->w; x++) {
-			px = x * src->w / dest->w;
-			py = y * src->h / dest->h;
-			pixel = get_pixel(src, px, py);
-			put_pixel(dest, x, y, pixel);
+	const uint32_t step_x = ((uint32_t)src->w << 16) / dest->w;
+	const uint32_t step_y = ((uint32_t)src->h << 16) / dest->h;
+	uint32_t sx, sy;
+	int py, last_py = -1;
+	int x, y;
+	const Uint32 *p_src;
+	Uint32 *p_dest;
+	for (y = 0, sy = 0; y < dest->h; y++, sy += step_y) {
+		py = sy >> 16;
+		p_dest = (Uint32 *)((Uint8 *)dest->pixels + (dest->pitch * y));
+		if (py == last_py) {
+			memcpy(p_dest, (Uint8 *)p_dest - dest->pitch, dest->w * bpp);
+			continue;
 		}
+		p_src = (const Uint32 *)((Uint8 *)src->pixels + (src->pitch * py));
+		for (x = 0, sx = 0; x < dest->w; x++, sx += step_x)
+			p_dest[x] = p_src[sx >> 16];
+		last_py = py;
 	}
-	return;
 }
 
-/*
+/* nearest neighbour 2x, 3x and 4x upscaling: each source row is widened
+ * once, then copied to the destination rows below it */
 void scale_nn2x(SDL_Surface* restrict src, SDL_Surface* restrict dest) {
-	int pixel;
-	int px, py;
-	for (int y = 0; y < src->h; y++) {
-		py = y * 2;
-		for (int x = 0; x < src->w; x++) {
-			px = x * 2;
-			pixel = get_pixel(src, x, y);
-			put_pixel(dest, px + 0, py + 0, pixel);
-			put_pixel(dest, px + 1, py + 0, pixel);
-			put_pixel(dest, px + 0, py + 1, pixel);
-			put_pixel(dest, px + 1, py + 1, pixel);
-		}
+	scale_rows(src, dest, 2, impl->widen[2], 0, src->h);
+}
+
+void scale_nn3x(SDL_Surface* restrict src, SDL_Surface* restrict dest) {
+	scale_rows(src, dest, 3, impl->widen[3], 0, src->h);
+}
+
+void scale_nn4x(SDL_Surface* restrict src, SDL_Surface* restrict dest) {
+	scale_rows(src, dest, 4, impl->widen[4], 0, src->h);
+}
+
+/* scales only source rows y0 to y1 (exclusive), for partial updates */
+void scale_nn_rows(SDL_Surface* restrict src, SDL_Surface* restrict dest,
+			int factor, int y0, int y1) {
+	assert(factor >= 2 && factor <= 4);
+	scale_rows(src, dest, factor, impl->widen[factor], y0, y1);
+}
+
+static void scale_rows(SDL_Surface* restrict src, SDL_Surface* restrict dest,
+			const int factor, const Widen widen, int y0, int y1) {
+	Uint8 *p_dest;
+	int y, i;
+	assert(dest->w >= (src->w * factor));
+	assert(dest->h >= (src->h * factor));
+	assert(y0 >= 0 && y1 <= src->h);
+	for (y = y0; y < y1; y++) {
+		p_dest = (Uint8 *)dest->pixels + (dest->pitch * y * factor);
+		widen((const Uint32 *)((Uint8 *)src->pixels + (src->pitch * y)),
+				(Uint32 *)p_dest, src->w);
+		for (i = 1; i < factor; i++)
+			memcpy(p_dest + (dest->pitch * i), p_dest, src->w * factor * bpp);
 	}
 }
-*/
 
-/* fast? nearest neighbour 2x upscaling */
-void scale_nn2x(SDL_Surface* restrict src, SDL_Surface* restrict dest) {
-	Uint8 * restrict p_src;
-	Uint8 * restrict p_dest;
-	Uint8 * restrict p_dest2;
-	Uint32 pixel;
-	int y, x;
-	assert(dest->w >= (src->w * 2));
-	assert(dest->h >= (src->h * 2));
-	for (y = 0; y < src->h; y++) {
-		p_src = (Uint8 *)src->pixels + (src->pitch * y);
-		p_dest = (Uint8 *)dest->pixels + (dest->pitch * y * 2);
-		p_dest2 = (Uint8 *)dest->pixels + dest->pitch * ((y * 2) + 1);
-		for (x = 0; x < src->w; x++) {
-			pixel = *(Uint32 *)p_src;
-			*(Uint32 *)(p_dest) = pixel;
-			*(Uint32 *)(p_dest + bpp) = pixel;
-			*(Uint32 *)(p_dest2) = pixel;
-			*(Uint32 *)(p_dest2 + bpp) = pixel;
-			p_src += bpp;
-			p_dest += bpp * 2;
-			p_dest2 += bpp * 2;
-		}
+static void widen2_c(const Uint32 * restrict src, Uint32 * restrict dest, int w) {
+	int x;
+	for (x = 0; x < w; x++) {
+		dest[0] = dest[1] = src[x];
+		dest += 2;
 	}
 }
 
-/* fast? nearest neighbour 3x upscaling */
-void scale_nn3x(SDL_Surface* restrict src, SDL_Surface* restrict dest) {
-	Uint8 * restrict p_src;
-	Uint8 * restrict p_dest;
-	Uint8 * restrict p_dest2;
-	Uint8 * restrict p_dest3;
-	Uint32 pixel;
-	int y, x;
-	assert(dest->w >= (src->w * 3));
-	assert(dest->h >= (src->h * 3));
-	for (y = 0; y < src->h; y++) {
-		p_src = (Uint8 *)src->pixels + (src->pitch * y);
-		p_dest = (Uint8 *)dest->pixels + (dest->pitch * y * 3);
-		p_dest2 = (Uint8 *)dest->pixels + dest->pitch * ((y * 3) + 1);
-		p_dest3 = (Uint8 *)dest->pixels + dest->pitch * ((y * 3) + 2);
-		for (x = 0; x < src->w; x++) {
-			pixel = *(Uint32 *)p_src;
-			*(Uint32 *)(p_dest) = pixel;
-			*(Uint32 *)(p_dest + bpp) = pixel;
-			*(Uint32 *)(p_dest + bpp + bpp) = pixel;
-			*(Uint32 *)(p_dest2) = pixel;
-			*(Uint32 *)(p_dest2 + bpp) = pixel;
-			*(Uint32 *)(p_dest2 + bpp + bpp) = pixel;
-			*(Uint32 *)(p_dest3) = pixel;
-			*(Uint32 *)(p_dest3 + bpp) = pixel;
-			*(Uint32 *)(p_dest3 + bpp + bpp) = pixel;
-			p_src += bpp;
-			p_dest += bpp * 3;
-			p_dest2 += bpp * 3;
-			p_dest3 += bpp * 3;
-		}
+static void widen3_c(const Uint32 * restrict src, Uint32 * restrict dest, int w) {
+	int x;
+	for (x = 0; x < w; x++) {
+		dest[0] = dest[1] = dest[2] = src[x];
+		dest += 3;
 	}
 }
 
-/* fast? nearest neighbour 4x upscaling */
-void scale_nn4x(SDL_Surface* restrict src, SDL_Surface* restrict dest) {
-	Uint8 * restrict p_src;
-	Uint8 * restrict p_dest;
-	Uint8 * restrict p_dest2;
-	Uint8 * restrict p_dest3;
-	Uint8 * restrict p_dest4;
-	Uint32 pixel;
-	int y, x;
-	assert(dest->w >= (src->w * 3));
-	assert(dest->h >= (src->h * 3));
-	for (y = 0; y < src->h; y++) {
-		p_src = (Uint8 *)src->pixels + (src->pitch * y);
-		p_dest = (Uint8 *)dest->pixels + (dest->pitch * y * 4);
-		p_dest2 = (Uint8 *)dest->pixels + dest->pitch * ((y * 4) + 1);
-		p_dest3 = (Uint8 *)dest->pixels + dest->pitch * ((y * 4) + 2);
-		p_dest4 = (Uint8 *)dest->pixels + dest->pitch * ((y * 4) + 3);
-		for (x = 0; x < src->w; x++) {
-			pixel = *(Uint32 *)p_src;
-			*(Uint32 *)(p_dest) = pixel;
-			*(Uint32 *)(p_dest + bpp) = pixel;
-			*(Uint32 *)(p_dest + bpp + bpp) = pixel;
-			*(Uint32 *)(p_dest + bpp + bpp + bpp) = pixel;
-			*(Uint32 *)(p_dest2) = pixel;
-			*(Uint32 *)(p_dest2 + bpp) = pixel;
-			*(Uint32 *)(p_dest2 + bpp + bpp) = pixel;
-			*(Uint32 *)(p_dest2 + bpp + bpp + bpp) = pixel;
-			*(Uint32 *)(p_dest3) = pixel;
-			*(Uint32 *)(p_dest3 + bpp) = pixel;
-			*(Uint32 *)(p_dest3 + bpp + bpp) = pixel;
-			*(Uint32 *)(p_dest3 + bpp + bpp + bpp) = pixel;
-			*(Uint32 *)(p_dest4) = pixel;
-			*(Uint32 *)(p_dest4 + bpp) = pixel;
-			*(Uint32 *)(p_dest4 + bpp + bpp) = pixel;
-			*(Uint32 *)(p_dest4 + bpp + bpp + bpp) = pixel;
-			p_src += bpp;
-			p_dest += bpp * 4;
-			p_dest2 += bpp * 4;
-			p_dest3 += bpp * 4;
-			p_dest4 += bpp * 4;
+static void widen4_c(const Uint32 * restrict src, Uint32 * restrict dest, int w) {
+	int x;
+	for (x = 0; x < w; x++) {
+		dest[0] = dest[1] = dest[2] = dest[3] = src[x];
+		dest += 4;
+	}
+}
+
+#ifdef SCALE_X86
+/* sse2: 4 source pixels at a time, spread with 32 bit shuffles */
+__attribute__((target("sse2")))
+static void widen2_sse2(const Uint32 * restrict src, Uint32 * restrict dest, int w) {
+	__m128i v;
+	int x;
+	for (x = 0; x + 4 <= w; x += 4) {
+		v = _mm_loadu_si128((const __m128i *)(src + x));
+		_mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi32(v, v));
+		_mm_storeu_si128((__m128i *)(dest + 4), _mm_unpackhi_epi32(v, v));
+		dest += 8;
+	}
+	widen2_c(src + x, dest, w - x);
+}
+
+__attribute__((target("sse2")))
+static void widen3_sse2(const Uint32 * restrict src, Uint32 * restrict dest, int w) {
+	__m128i v;
+	int x;
+	for (x = 0; x + 4 <= w; x += 4) {
+		v = _mm_loadu_si128((const __m128i *)(src + x));
+		_mm_storeu_si128((__m128i *)dest, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+		_mm_storeu_si128((__m128i *)(dest + 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+		_mm_storeu_si128((__m128i *)(dest + 8), _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+		dest += 12;
+	}
+	widen3_c(src + x, dest, w - x);
+}
+
+__attribute__((target("sse2")))
+static void widen4_sse2(const Uint32 * restrict src, Uint32 * restrict dest, int w) {
+	__m128i v;
+	int x;
+	for (x = 0; x + 4 <= w; x += 4) {
+		v = _mm_loadu_si128((const __m128i *)(src + x));
+		_mm_storeu_si128((__m128i *)dest, _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 0, 0, 0)));
+		_mm_storeu_si128((__m128i *)(dest + 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 1, 1, 1)));
+		_mm_storeu_si128((__m128i *)(dest + 8), _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 2, 2)));
+		_mm_storeu_si128((__m128i *)(dest + 12), _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3)));
+		dest += 16;
+	}
+	widen4_c(src + x, dest, w - x);
+}
+
+/* avx2: 8 source pixels at a time, spread with cross lane permutes */
+__attribute__((target("avx2")))
+static void widen2_avx2(const Uint32 * restrict src, Uint32 * restrict dest, int w) {
+	const __m256i lo = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+	const __m256i hi = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+	__m256i v;
+	int x;
+	for (x = 0; x + 8 <= w; x += 8) {
+		v = _mm256_loadu_si256((const __m256i *)(src + x));
+		_mm256_storeu_si256((__m256i *)dest, _mm256_permutevar8x32_epi32(v, lo));
+		_mm256_storeu_si256((__m256i *)(dest + 8), _mm256_permutevar8x32_epi32(v, hi));
+		dest += 16;
+	}
+	widen2_c(src + x, dest, w - x);
+}
+
+__attribute__((target("avx2")))
+static void widen3_avx2(const Uint32 * restrict src, Uint32 * restrict dest, int w) {
+	const __m256i a = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+	const __m256i b = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+	const __m256i c = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+	__m256i v;
+	int x;
+	for (x = 0; x + 8 <= w; x += 8) {
+		v = _mm256_loadu_si256((const __m256i *)(src + x));
+		_mm256_storeu_si256((__m256i *)dest, _mm256_permutevar8x32_epi32(v, a));
+		_mm256_storeu_si256((__m256i *)(dest + 8), _mm256_permutevar8x32_epi32(v, b));
+		_mm256_storeu_si256((__m256i *)(dest + 16), _mm256_permutevar8x32_epi32(v, c));
+		dest += 24;
+	}
+	widen3_c(src + x, dest, w - x);
+}
+
+__attribute__((target("avx2")))
+static void widen4_avx2(const Uint32 * restrict src, Uint32 * restrict dest, int w) {
+	const __m256i a = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+	const __m256i b = _mm256_setr_epi32(2, 2, 2, 2, 3, 3, 3, 3);
+	const __m256i c = _mm256_setr_epi32(4, 4, 4, 4, 5, 5, 5, 5);
+	const __m256i d = _mm256_setr_epi32(6, 6, 6, 6, 7, 7, 7, 7);
+	__m256i v;
+	int x;
+	for (x = 0; x + 8 <= w; x += 8) {
+		v = _mm256_loadu_si256((const __m256i *)(src + x));
+		_mm256_storeu_si256((__m256i *)dest, _mm256_permutevar8x32_epi32(v, a));
+		_mm256_storeu_si256((__m256i *)(dest + 8), _mm256_permutevar8x32_epi32(v, b));
+		_mm256_storeu_si256((__m256i *)(dest + 16), _mm256_permutevar8x32_epi32(v, c));
+		_mm256_storeu_si256((__m256i *)(dest + 24), _mm256_permutevar8x32_epi32(v, d));
+		dest += 32;
+	}
+	widen4_c(src + x, dest, w - x);
+}
+#endif
+
+/* times each scale factor with every widener the cpu can run, on a gb
+ * sized frame */
+void scale_benchmark(void) {
+	const ScaleImpl *impls[3];
+	const ScaleImpl *saved = impl;
+	SDL_Surface *src, *dest;
+	uint64_t start;
+	int count = 0;
+	int factor, i, j;
+	impls[count++] = &scalar_impl;
+#ifdef SCALE_X86
+	if (__builtin_cpu_supports("sse2"))
+		impls[count++] = &sse2_impl;
+	if (__builtin_cpu_supports("avx2"))
+		impls[count++] = &avx2_impl;
+#endif
+	src = SDL_CreateRGBSurface(SDL_SWSURFACE, 160, 144, 32, 0, 0, 0, 0);
+	for (factor = 2; factor <= 4; factor++) {
+		dest = SDL_CreateRGBSurface(SDL_SWSURFACE, 160 * factor, 144 * factor, 32, 0, 0, 0, 0);
+		for (i = 0; i < count; i++) {
+			impl = impls[i];
+			start = stats_now();
+			for (j = 0; j < BENCHMARK_FRAMES; j++)
+				scale_rows(src, dest, factor, impl->widen[factor], 0, src->h);
+			printf("scale benchmark: %ix %-6s: %.1fus per frame\n", factor,
+					impl->name, (stats_now() - start) / BENCHMARK_FRAMES / 1000.0);
 		}
+		impl = saved;
+		start = stats_now();
+		for (j = 0; j < BENCHMARK_FRAMES; j++)
+			scale_nn(src, dest);
+		printf("scale benchmark: %ix %-6s: %.1fus per frame\n", factor,
+				"any", (stats_now() - start) / BENCHMARK_FRAMES / 1000.0);
+		SDL_FreeSurface(dest);
 	}
+	SDL_FreeSurface(src);
 }
 
 #if 0
@@ -205,14 +345,3 @@ void blur(SDL_Surface* restrict s) {
 	
 }
 #endif
-
-static inline Uint32 get_pixel(const SDL_Surface* restrict surface, const int x, const int y) {
-	return *(Uint32 *)((Uint8 *)surface->pixels + (y * surface->pitch) + (x * 4));
-}
-
-static inline void put_pixel(const SDL_Surface* restrict surface, const int x, const int y, const Uint32 pixel) {
-	*(Uint32 *)((Uint8 *)surface->pixels + (y * surface->pitch) + (x * 4)) = pixel;
-}
-
-
-
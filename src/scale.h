@@ -30,10 +30,14 @@
 #include <SDL/SDL.h>
 #include "gbem.h"
 
+void scale_init(void);
+void scale_benchmark(void);
 void scale_nn(SDL_Surface *src, SDL_Surface *dest);
 void scale_nn2x(SDL_Surface* restrict src, SDL_Surface* restrict dest);
 void scale_nn3x(SDL_Surface* restrict src, SDL_Surface* restrict dest);
 void scale_nn4x(SDL_Surface* restrict src, SDL_Surface* restrict dest);
+void scale_nn_rows(SDL_Surface* restrict src, SDL_Surface* restrict dest,
+			int factor, int y0, int y1);
 void blur(SDL_Surface* restrict s);
 
 #endif /* _SCALE_H */
@@ -33,7 +33,9 @@
 #include "gbem.h"
 #include "sound.h"
 #include "memory.h"
+#include "core.h"
 #include "save.h"
+#include "stats.h"
 #include "blip_buf.h"
 
 #define MAX_SAMPLE			32767
@@ -45,6 +47,10 @@
 #define LFSR_15_SIZE		32768
 #define LFSR_15				0
 #define LFSR_7				1
+/* longest stretch synthesised in one go: one video frame */
+#define SYNC_MAX_CLOCKS		70224
+/* samples the audio device asks for at a time */
+#define AUDIO_SAMPLES		2048
 
 enum Side { LEFT, RIGHT };
 enum Counter { PERIOD, LENGTH, ENVELOPE, SWEEP };
@@ -52,6 +58,9 @@ enum Counter { PERIOD, LENGTH, ENVELOPE, SWEEP };
 static inline void mark_channel_on(unsigned int channel);
 static inline void mark_channel_off(unsigned int channel);
 static void callback(void* data, Uint8 *stream, int len);
+static void catch_up(void);
+static void make_room(unsigned clocks);
+static void update_register(Word address, Byte value);
 static inline void update_channel1(int clocks);
 static inline void update_channel2(int clocks);
 static inline void update_channel3(int clocks);
@@ -78,21 +87,31 @@ static const unsigned char gbc_wave[] = {
 };
 
 int sound_enabled;
-int sound_cycles;
+/* without a device, as when headless, the sound is still made but the
+ * samples are thrown away as they pile up */
+static int has_device;
 
 static short *lfsr[2];
 static unsigned lfsr_size[2];
 static short* wave_samples;
 static int sample_rate = 44100;
+static int buffer_size;
+/* rate the sound is resampled from: the master clock scaled by the speed */
+static double clock_rate = MASTER_CLOCK_HZ;
 static blip_t* blip_left;
 static blip_t* blip_right;
 static SoundData sound;
 static SDL_mutex *sound_mutex;
 
+static Counter lock_counter = { "sound mutex locks" };
+static Counter synth_counter = { "sound synthesis passes" };
+static Counter drop_counter = { "sound samples dropped" };
+
+extern CoreState core;
 extern int console;
 extern int console_mode;
 
-void sound_init(void) {
+void sound_init(const int is_device) {
 	unsigned char r7;
 	unsigned short r15;
 	unsigned int i;
@@ -128,28 +147,35 @@ void sound_init(void) {
 	
 	wave_samples = malloc(32 * sizeof(short));
 
-	SDL_InitSubSystem(SDL_INIT_AUDIO);
-
-	desired.freq = sample_rate;
-	desired.format = AUDIO_S16SYS;
-	desired.channels = 2;
-	desired.samples = 2048;
-	desired.callback = callback;
-	desired.userdata = NULL;
-	
-	if (SDL_OpenAudio(&desired, NULL) < 0) {
-		fprintf(stderr, "couldn't initialise SDL audio: %s\n", SDL_GetError());
-		exit(1);
-   	}
-	fprintf(stdout, "sdl audio initialised.\n");
+	has_device = is_device;
+	if (has_device) {
+		SDL_InitSubSystem(SDL_INIT_AUDIO);
+
+		desired.freq = sample_rate;
+		desired.format = AUDIO_S16SYS;
+		desired.channels = 2;
+		desired.samples = AUDIO_SAMPLES;
+		desired.callback = callback;
+		desired.userdata = NULL;
+		
+		if (SDL_OpenAudio(&desired, NULL) < 0) {
+			fprintf(stderr, "couldn't initialise SDL audio: %s\n", SDL_GetError());
+			exit(1);
+		}
+		fprintf(stdout, "sdl audio initialised.\n");
+	}
 	
-	blip_left = blip_new(sample_rate / 10);
-	blip_set_rates(blip_left, 4194304, sample_rate);
+	buffer_size = sample_rate / 10;
+	blip_left = blip_new(buffer_size);
+	blip_set_rates(blip_left, clock_rate, sample_rate);
 
-	blip_right = blip_new(sample_rate / 10);
-	blip_set_rates(blip_right, 4194304, sample_rate);
+	blip_right = blip_new(buffer_size);
+	blip_set_rates(blip_right, clock_rate, sample_rate);
 
     sound_mutex = SDL_CreateMutex();
+	stats_register(&lock_counter);
+	stats_register(&synth_counter);
+	stats_register(&drop_counter);
 	sound_enabled = 0;
 	start_sound();
 }
@@ -158,20 +184,23 @@ void sound_fini(void) {
 	if (sound_enabled == 1) {
 		stop_sound();
 	}
-	SDL_CloseAudio();
+	if (has_device)
+		SDL_CloseAudio();
 	free(lfsr[LFSR_7]);
 	free(lfsr[LFSR_15]);
 }
 
 void stop_sound(void) {
 	assert(sound_enabled == 1);
-	SDL_PauseAudio(1);
+	if (has_device)
+		SDL_PauseAudio(1);
 	sound_enabled = 0;
 }
 
 void start_sound(void) {
 	assert(sound_enabled == 0);
-	SDL_PauseAudio(0);
+	if (has_device)
+		SDL_PauseAudio(0);
 	sound_enabled = 1;
 }
 
@@ -229,6 +258,7 @@ void sound_reset(void) {
 	sound.channel4.length.i = 16384;
 	sound.channel4.envelope.i = 65536;
 
+	sound.last_sync = core.clock;
 
 	if ((console == CONSOLE_GBC) || (console == CONSOLE_GBA)) {
 		for (int i = 0; i < 16; i++)
@@ -241,13 +271,20 @@ void sound_reset(void) {
 	if (!sound_enabled) {
 		start_sound();
 	}
-	
-	sound_cycles = 0;
 }
 
+/* sound register writes bring the sound up to date first, so that the
+ * change takes effect at the right time. */
 void write_sound(Word address, Byte value) {
+	SDL_LockMutex(sound_mutex);
+	counter_inc(&lock_counter);
+	catch_up();
+	update_register(address, value);
+	SDL_UnlockMutex(sound_mutex);
+}
+
+static void update_register(Word address, Byte value) {
 	unsigned freq;
-	sound_update();
 
 	//fprintf(stderr, "%hx: %hhx\n", address, value);
 
@@ -465,9 +502,13 @@ void write_sound(Word address, Byte value) {
  */
 void write_wave(Word address, Byte value) {
 	const short scale = ((HIGH * 2) / 15);
+	SDL_LockMutex(sound_mutex);
+	counter_inc(&lock_counter);
+	catch_up();
 	wave_samples[(address - 0xff30) * 2] = ((value >> 4) - 7) * scale;
 	wave_samples[(address - 0xff30) * 2 + 1] = ((value & 0x0f) - 7) * scale;
 	write_io(address, value);	
+	SDL_UnlockMutex(sound_mutex);
 }
 
 
@@ -481,23 +522,84 @@ static inline void mark_channel_off(unsigned int channel) {
 	write_io(HWREG_NR52, read_io(HWREG_NR52) & ~(0x01 << (channel - 1)));
 }
 
-void sound_update() {
-	if (sound_cycles == 0)
-		return;
-
-	//SDL_LockAudio();
+/* changes the rate the sound is resampled at to follow an emulation speed,
+ * given in percent (0 is unlimited). normally the pitch follows the speed,
+ * as on a tape. with keep_pitch, when fast, the sound is resampled at the
+ * normal rate instead, and the samples which don't fit are dropped. slower
+ * than normal the pitch always follows the speed: keeping it would need
+ * the sound stretched, not just resampled, or the device would run dry. */
+void sound_set_speed(unsigned int percent, int keep_pitch) {
+	double rate = MASTER_CLOCK_HZ;
+	if ((percent != 0) && ((percent < 100) || !keep_pitch))
+		rate = (double)MASTER_CLOCK_HZ * percent / 100;
 	SDL_LockMutex(sound_mutex);
-	update_channel1(sound_cycles);
-	update_channel2(sound_cycles);
-	update_channel3(sound_cycles);
-	update_channel4(sound_cycles);
+	counter_inc(&lock_counter);
+	/* what has already been emulated keeps the old rate */
+	catch_up();
+	clock_rate = rate;
+	blip_set_rates(blip_left, clock_rate, sample_rate);
+	blip_set_rates(blip_right, clock_rate, sample_rate);
+	SDL_UnlockMutex(sound_mutex);
+}
 
-	blip_end_frame(blip_left, sound_cycles);
-	blip_end_frame(blip_right, sound_cycles);
+/* catches the sound up with the master clock. the sound is not advanced
+ * as the cpu runs: this is called when a sound register or wave ram is
+ * written, when NR52 is read, once per frame and when the audio device
+ * needs more samples. */
+void sound_sync(void) {
+	SDL_LockMutex(sound_mutex);
+	counter_inc(&lock_counter);
+	catch_up();
 	SDL_UnlockMutex(sound_mutex);
+}
+
+/* synthesises everything between the last sync and the master clock, in
+ * one pass per video frame. like the lcd, the sound hardware runs at the
+ * same speed in both cpu speed modes. sound_mutex must be held. */
+static void catch_up(void) {
+	uint64_t now = core.clock;
+	uint64_t start;
+	unsigned clocks;
 
-	sound_cycles = 0;
-	//SDL_UnlockAudio();
+	/* the audio thread can see a slightly stale clock */
+	if (now <= sound.last_sync)
+		return;
+	start = stats_now();
+	while (sound.last_sync < now) {
+		clocks = (unsigned)(now - sound.last_sync);
+		if (clocks > SYNC_MAX_CLOCKS)
+			clocks = SYNC_MAX_CLOCKS;
+		make_room(clocks);
+		update_channel1(clocks);
+		update_channel2(clocks);
+		update_channel3(clocks);
+		update_channel4(clocks);
+
+		blip_end_frame(blip_left, clocks);
+		blip_end_frame(blip_right, clocks);
+		sound.last_sync += clocks;
+	}
+	counter_stop(&synth_counter, start);
+}
+
+/* if the audio device is not keeping up (the emulator is paused, sound is
+ * off, or it is running too fast), throw away the oldest samples so that
+ * there is space for 'clocks' more. */
+static void make_room(unsigned clocks) {
+	short discard[512];
+	int needed = (int)(clocks * sample_rate / clock_rate) + 2;
+	int excess = blip_samples_avail(blip_left) + needed - buffer_size;
+	int count;
+	if (excess <= 0)
+		return;
+	if (has_device)
+		counter_add(&drop_counter, excess);
+	while (excess > 0) {
+		count = excess < 512 ? excess : 512;
+		blip_read_samples(blip_left, discard, count, 0);
+		blip_read_samples(blip_right, discard, count, 0);
+		excess -= count;
+	}
 }
 
 static void update_channel1(int clocks) {
@@ -819,14 +921,15 @@ void sound_save(void) {
 }
 
 void sound_load(void) {
-	
+	sound.last_sync = core.clock;
 }
 
 static void callback(void* data, Uint8 *stream, int len) {
 	Sint16 *buffer = (Sint16 *)stream;
-	sound_update();
 	
 	SDL_LockMutex(sound_mutex);
+	counter_inc(&lock_counter);
+	catch_up();
 	blip_read_samples(blip_left, buffer, len / 4, 1);
 	blip_read_samples(blip_right, buffer + 1, len / 4, 1);
 	SDL_UnlockMutex(sound_mutex);
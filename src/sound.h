@@ -31,7 +31,7 @@
 
 #include "gbem.h"
 
-void sound_update();
+void sound_sync(void);
 
 typedef struct {
 	unsigned duty;
@@ -123,9 +123,11 @@ typedef struct {
 	SquareChannel channel2;
 	SampleChannel channel3;
 	NoiseChannel channel4;
+	/* master clock time the sound was last brought up to date */
+	uint64_t last_sync;
 } SoundData;
 
-void sound_init(void);
+void sound_init(const int is_device);
 void sound_fini(void);
 void write_sound(Word address, Byte value);
 void write_wave(Word address, Byte value);
@@ -134,6 +136,7 @@ void start_sound(void);
 void sound_save(void);
 void sound_load(void);
 void sound_reset(void);
+void sound_set_speed(unsigned int percent, int keep_pitch);
 
 #endif /* _SOUND_H */
 
@@ -0,0 +1,122 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of jonny nor the name of any other
+ *    contributor may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY jonny AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL jonny OR ANY OTHER
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, 
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if !defined _WIN64 && !defined _WIN32
+#define _POSIX_C_SOURCE 199309L
+#include <time.h>
+#else
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include <inttypes.h>
+#include "stats.h"
+
+static Counter *counters = NULL;
+static Histogram *histograms = NULL;
+
+static void report_histogram(const Histogram *h);
+static uint64_t frames = 0;
+
+/* adds a counter to the report. registering a counter twice does nothing */
+void stats_register(Counter *c) {
+	Counter *i;
+	for (i = counters; i != NULL; i = i->next) {
+		if (i == c)
+			return;
+	}
+	c->next = counters;
+	counters = c;
+}
+
+/* adds a histogram to the report. registering it twice does nothing */
+void stats_register_histogram(Histogram *h) {
+	Histogram *i;
+	for (i = histograms; i != NULL; i = i->next) {
+		if (i == h)
+			return;
+	}
+	h->next = histograms;
+	histograms = h;
+}
+
+void stats_frame(void) {
+	++frames;
+}
+
+void stats_report(void) {
+	Counter *c;
+	Histogram *h;
+	uint64_t f = (frames > 0) ? frames : 1;
+	if ((counters == NULL) && (histograms == NULL))
+		return;
+	printf("statistics over %" PRIu64 " frames:\n", frames);
+	if (counters != NULL) {
+		printf("\t%-28s %14s %12s %14s %10s\n", "counter", "total", "per frame", "us per frame", "us each");
+		for (c = counters; c != NULL; c = c->next) {
+			printf("\t%-28s %14" PRIu64 " %12.2f %14.2f %10.2f\n", c->name, c->count,
+					(double)c->count / f, (double)c->time / f / 1000.0,
+					c->count ? (double)c->time / c->count / 1000.0 : 0.0);
+			if ((c->of != NULL) && (c->of->count > 0))
+				printf("\t\t%.1f%% of %s\n", 100.0 * c->count / c->of->count, c->of->name);
+		}
+	}
+	for (h = histograms; h != NULL; h = h->next)
+		report_histogram(h);
+}
+
+/* prints the non-empty buckets of a histogram, one per line */
+static void report_histogram(const Histogram *h) {
+	uint64_t total = 0;
+	unsigned int i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		total += h->buckets[i];
+	printf("\t%s (%" PRIu64 " total):\n", h->name, total);
+	if (total == 0)
+		return;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (h->buckets[i] == 0)
+			continue;
+		if (i == HISTOGRAM_BUCKETS - 1)
+			printf("\t\t%6u+       ", i * h->width);
+		else
+			printf("\t\t%6u - %-6u", i * h->width, (i + 1) * h->width - 1);
+		printf(" %14" PRIu64 " %7.2f%%\n", h->buckets[i], 100.0 * h->buckets[i] / total);
+	}
+}
+
+/* returns a monotonic host time in ns */
+uint64_t stats_now(void) {
+#if !defined _WIN64 && !defined _WIN32
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+#else
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (uint64_t)((double)count.QuadPart * 1000000000.0 / freq.QuadPart);
+#endif
+}
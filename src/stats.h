@@ -0,0 +1,81 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of jonny nor the name of any other
+ *    contributor may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY jonny AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL jonny OR ANY OTHER
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, 
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+
+/* a named performance counter. counters are registered once and reported
+ * as totals and per frame averages when the emulator quits. */
+typedef struct counter {
+	const char *name;
+	uint64_t count;		/* number of events */
+	uint64_t time;		/* host time spent, in ns */
+	struct counter *next;
+	const struct counter *of;	/* if set, also reported as a share of it */
+} Counter;
+
+#define HISTOGRAM_BUCKETS	32
+
+/* a named histogram of values, such as slice lengths. values are counted
+ * in buckets of 'width'; anything past the last bucket goes into it. */
+typedef struct histogram {
+	const char *name;
+	unsigned int width;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+	struct histogram *next;
+} Histogram;
+
+void stats_register(Counter *c);
+void stats_register_histogram(Histogram *h);
+void stats_frame(void);
+void stats_report(void);
+uint64_t stats_now(void);
+
+/* counters can be updated from several threads at once */
+static inline void counter_inc(Counter *c) {
+	__sync_fetch_and_add(&c->count, 1);
+}
+
+static inline void counter_add(Counter *c, uint64_t n) {
+	__sync_fetch_and_add(&c->count, n);
+}
+
+/* counts an event which started at host time 'start' (from stats_now()) */
+static inline void counter_stop(Counter *c, uint64_t start) {
+	__sync_fetch_and_add(&c->count, 1);
+	__sync_fetch_and_add(&c->time, stats_now() - start);
+}
+
+static inline void histogram_add(Histogram *h, unsigned int value) {
+	unsigned int i = value / h->width;
+	if (i >= HISTOGRAM_BUCKETS)
+		i = HISTOGRAM_BUCKETS - 1;
+	++h->buckets[i];
+}
+
+#endif /* _STATS_H */
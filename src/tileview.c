@@ -0,0 +1,326 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of jonny nor the name of any other
+ *    contributor may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY jonny AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL jonny OR ANY OTHER
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, 
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+ 
+#include <SDL/SDL.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tileview.h"
+#include "display.h"
+#include "memory.h"
+#include "stats.h"
+
+/* the picture: the 384 tiles of each vram bank side by side at the top
+ * left, the 40 sprites to their right, and the two tile maps below */
+#define VIEW_W				520
+#define VIEW_H				456
+#define TILES_X				0
+#define TILES_Y				0
+#define OAM_X				264
+#define OAM_Y				0
+#define MAPS_X				0
+#define MAPS_Y				200
+#define MAP_GAP				8
+
+/* the tiles of a bank in vram order, 0x8000 to 0x97ff */
+#define BANK_TILES			384
+#define MAP_CELLS			1024
+
+static void draw_tile(const int x, const int y, const Byte *codes, const int is_lit);
+static void draw_blank(const int x, const int y);
+static Tile *view_tile(const unsigned int bank, const unsigned int k);
+static int write_view(void);
+static void copy_bands(void);
+static int view_loop(void *data);
+
+/* everything is drawn once when the view starts, and after that only what
+ * has changed. a tile is drawn again when it is written, and once more on
+ * the next frame to take the red off, and so is every map cell and sprite
+ * which uses it. */
+static Byte (*image)[VIEW_W][3] = NULL;
+static char *view_path = NULL;
+static char *temp_path = NULL;
+static int is_full;
+static unsigned int tile_version[2][BANK_TILES];
+static Byte tile_lit[2][BANK_TILES];
+/* the code and attributes each map cell was last drawn with */
+static Byte map_cells[2][2][MAP_CELLS];
+static Byte map_lit[2][MAP_CELLS];
+static Byte map_select;
+static Byte oam_drawn[OAM_BLOCKS * OAM_BLOCK_SIZE];
+static Byte oam_lit[OAM_BLOCKS];
+static int oam_height;
+
+/* the picture is copied for the writer thread, so the emulator never waits
+ * for the disk. a picture finished while the last one is still being
+ * written is held until the writer is free. */
+static Byte (*out)[VIEW_W][3] = NULL;
+static SDL_sem *view_sem;
+static SDL_Thread *thread = NULL;
+static volatile int is_writing;
+static volatile int is_view_quit;
+static volatile int is_view_failed;
+static int is_pending;
+/* the bands of 8 lines drawn since the picture was last copied */
+static Byte band_dirty[VIEW_H / 8];
+
+static const Byte greys[4] = { 0xff, 0xaa, 0x55, 0x00 };
+
+static Counter view_counter = { "tile view updates" };
+static Counter view_tile_counter = { "tile view tiles drawn" };
+static Counter view_write_counter = { "tile view files written", .of = &view_counter };
+
+extern Display display;
+extern int console_mode;
+
+void tileview_start(const char *path) {
+	if (image == NULL) {
+		image = malloc(VIEW_H * sizeof(*image));
+		out = malloc(VIEW_H * sizeof(*out));
+		stats_register(&view_counter);
+		stats_register(&view_tile_counter);
+		stats_register(&view_write_counter);
+	}
+	tileview_stop();
+	view_path = malloc(strlen(path) + 1);
+	strcpy(view_path, path);
+	/* written beside the real file and renamed over it, so whatever is
+	 * watching the file never sees half a picture */
+	temp_path = malloc(strlen(path) + sizeof(".tmp"));
+	sprintf(temp_path, "%s.tmp", path);
+	memset(image, 0x40, VIEW_H * sizeof(*image));
+	memset(band_dirty, 1, sizeof(band_dirty));
+	is_full = 1;
+	is_pending = 0;
+	is_writing = 0;
+	is_view_quit = 0;
+	is_view_failed = 0;
+	view_sem = SDL_CreateSemaphore(0);
+	thread = SDL_CreateThread(view_loop, NULL);
+	printf("tile view in %s\n", path);
+}
+
+/* waits for the picture being written, stops the writer, then writes the
+ * picture held back while it was busy */
+void tileview_stop(void) {
+	if (thread == NULL)
+		return;
+	is_view_quit = 1;
+	SDL_SemPost(view_sem);
+	SDL_WaitThread(thread, NULL);
+	thread = NULL;
+	SDL_DestroySemaphore(view_sem);
+	if (is_pending && !is_view_failed) {
+		copy_bands();
+		write_view();
+	}
+	is_pending = 0;
+	free(view_path);
+	free(temp_path);
+	view_path = temp_path = NULL;
+}
+
+/* brings the picture up to date at the end of a frame */
+void tileview_frame(void) {
+	const unsigned int banks = (console_mode == MODE_GBC_ENABLED) ? 2 : 1;
+	const Byte select = read_io(HWREG_LCDC) & 0x10;
+	const Byte *codes, *oam;
+	unsigned int b, k, m, c, i, pattern, drawn = 0;
+	uint64_t start;
+	int is_lit, is_map_full, is_oam_full, flip, x, y;
+	Byte attrib = 0;
+	Tile *t;
+	if (thread == NULL)
+		return;
+	if (is_view_failed) {
+		tileview_stop();
+		printf("tile view stopped\n");
+		return;
+	}
+	start = stats_now();
+
+	for (b = 0; b < banks; b++) {
+		for (k = 0; k < BANK_TILES; k++) {
+			t = view_tile(b, k);
+			is_lit = t->version != tile_version[b][k];
+			if (!is_full && !is_lit && !tile_lit[b][k])
+				continue;
+			draw_tile(TILES_X + (b * 128) + ((k % 16) * 8), TILES_Y + ((k / 16) * 8),
+					display_tile_codes(t, NO_FLIP), is_lit);
+			tile_version[b][k] = t->version;
+			tile_lit[b][k] = is_lit;
+			++drawn;
+		}
+	}
+
+	/* the maps are drawn with the tile data lcdc has selected */
+	is_map_full = is_full || (select != map_select);
+	map_select = select;
+	for (m = 0; m < 2; m++) {
+		codes = display.vram + (m ? TILE_MAP_1 : TILE_MAP_0) - MEM_VIDEO;
+		for (c = 0; c < MAP_CELLS; c++) {
+			if (banks == 2)
+				attrib = codes[VRAM_BANK_SIZE + c];
+			b = (attrib & 0x08) ? 1 : 0;
+			k = select ? codes[c] : 128 + (codes[c] ^ 0x80);
+			if (!is_map_full && (codes[c] == map_cells[m][0][c]) && (attrib == map_cells[m][1][c]) &&
+					!tile_lit[b][k] && !map_lit[m][c])
+				continue;
+			draw_tile(MAPS_X + (m * (BG_W + MAP_GAP)) + ((c % 32) * 8), MAPS_Y + ((c / 32) * 8),
+					display_tile_codes(view_tile(b, k), (attrib >> 5) & 0x03), tile_lit[b][k]);
+			map_cells[m][0][c] = codes[c];
+			map_cells[m][1][c] = attrib;
+			map_lit[m][c] = tile_lit[b][k];
+			++drawn;
+		}
+	}
+
+	/* each sprite gets an 8x16 cell, the lower half blank for 8x8 sprites */
+	is_oam_full = is_full || (display.sprite_height != oam_height);
+	oam_height = display.sprite_height;
+	for (i = 0; i < OAM_BLOCKS; i++) {
+		oam = display.oam + (i * OAM_BLOCK_SIZE);
+		pattern = oam[OAM_PATTERN];
+		if (oam_height == 16)
+			pattern &= 0xfe;
+		b = ((banks == 2) && (oam[OAM_FLAGS] & 0x08)) ? 1 : 0;
+		is_lit = tile_lit[b][pattern] || ((oam_height == 16) && tile_lit[b][pattern + 1]);
+		if (!is_oam_full && (memcmp(oam, oam_drawn + (i * OAM_BLOCK_SIZE), OAM_BLOCK_SIZE) == 0) &&
+				!is_lit && !oam_lit[i])
+			continue;
+		flip = (oam[OAM_FLAGS] >> 5) & 0x03;
+		x = OAM_X + ((i % 10) * 8);
+		y = OAM_Y + ((i / 10) * 16);
+		if (oam_height == 16) {
+			if (flip & Y_FLIP)
+				pattern ^= 1;
+			draw_tile(x, y, display_tile_codes(view_tile(b, pattern), flip), is_lit);
+			draw_tile(x, y + 8, display_tile_codes(view_tile(b, pattern ^ 1), flip), is_lit);
+		} else {
+			draw_tile(x, y, display_tile_codes(view_tile(b, pattern), flip), is_lit);
+			draw_blank(x, y + 8);
+		}
+		memcpy(oam_drawn + (i * OAM_BLOCK_SIZE), oam, OAM_BLOCK_SIZE);
+		oam_lit[i] = is_lit;
+		++drawn;
+	}
+
+	is_full = 0;
+	if (drawn > 0) {
+		counter_add(&view_tile_counter, drawn);
+		is_pending = 1;
+	}
+	if (is_pending && !is_writing) {
+		copy_bands();
+		is_pending = 0;
+		is_writing = 1;
+		SDL_SemPost(view_sem);
+	}
+	counter_stop(&view_counter, start);
+}
+
+/* tiles written during the frame are tinted red, keeping their shading */
+static void draw_tile(const int x, const int y, const Byte *codes, const int is_lit) {
+	Byte *px;
+	Byte grey;
+	int i, j;
+	band_dirty[y / 8] = 1;
+	for (j = 0; j < 8; j++) {
+		px = image[y + j][x];
+		for (i = 0; i < 8; i++, px += 3) {
+			grey = greys[codes[(j * 8) + i] & 0x03];
+			px[0] = is_lit ? 0xff - ((0xff - grey) >> 1) : grey;
+			px[1] = px[2] = is_lit ? grey >> 1 : grey;
+		}
+	}
+}
+
+static void draw_blank(const int x, const int y) {
+	int j;
+	band_dirty[y / 8] = 1;
+	for (j = 0; j < 8; j++)
+		memset(image[y + j][x], 0x40, 8 * 3);
+}
+
+/* tile k of a bank in vram order. the tiles from 0x8800 to 0x8fff are in
+ * both tile data tables, and are taken from the first. */
+static Tile *view_tile(const unsigned int bank, const unsigned int k) {
+	if (k < 256)
+		return &display.tiles_tdt_0[(bank * 256) + k];
+	return &display.tiles_tdt_1[(bank * 256) + k - 128];
+}
+
+/* copies the bands drawn since the last copy for the writer */
+static void copy_bands(void) {
+	unsigned int band;
+	for (band = 0; band < VIEW_H / 8; band++) {
+		if (band_dirty[band])
+			memcpy(out[band * 8], image[band * 8], 8 * sizeof(*image));
+		band_dirty[band] = 0;
+	}
+}
+
+/* a picture posted before the quit is written before the writer stops */
+static int view_loop(void *data) {
+	while (1) {
+		SDL_SemWait(view_sem);
+		if (is_writing) {
+			if (!write_view())
+				is_view_failed = 1;
+			__sync_synchronize();
+			is_writing = 0;
+		}
+		if (is_view_quit || is_view_failed)
+			break;
+	}
+	return 0;
+}
+
+/* returns 0 if the picture could not be written. the view is stopped by
+ * the next tileview_frame() */
+static int write_view(void) {
+	FILE *file = fopen(temp_path, "wb");
+	int is_ok;
+	if (file == NULL) {
+		fprintf(stderr, "tile view: could not open %s\n", temp_path);
+		return 0;
+	}
+	fprintf(file, "P6\n%d %d\n255\n", VIEW_W, VIEW_H);
+	is_ok = fwrite(out, sizeof(*out), VIEW_H, file) == VIEW_H;
+	if (fclose(file) != 0)
+		is_ok = 0;
+	if (!is_ok) {
+		fprintf(stderr, "tile view: write failed\n");
+		return 0;
+	}
+	if (rename(temp_path, view_path) != 0) {
+		fprintf(stderr, "tile view: could not replace %s\n", view_path);
+		return 0;
+	}
+	counter_inc(&view_write_counter);
+	return 1;
+}
@@ -25,25 +25,69 @@
  */
 
 
+#include <limits.h>
 #include "timer.h"
 #include "memory.h"
 #include "core.h"
+#include "save.h"
 
 static unsigned int tima_time;
 static unsigned int div_time;
+/* master clock time the timer was last brought up to date */
+static uint64_t last_sync;
+
+extern CoreState core;
 
 // periods for each tima setting, in machine cycles
 static const unsigned int tima_periods[] = {1024, 16, 64, 256};
 
 static inline unsigned int get_tima_period(void);
 static inline unsigned int get_div_period(void);
+static void timer_check(unsigned int period);
 
 void timer_reset(void) {
 	tima_time = 0;
 	div_time = 0;
+	last_sync = core.clock;
+}
+
+/* catches the timer up with the master clock. the timer runs off the cpu
+ * clock, so it runs twice as fast in double speed mode. */
+void timer_sync(void) {
+	unsigned int ticks = (unsigned int)(core.clock - last_sync);
+	last_sync = core.clock;
+	if (ticks != 0)
+		timer_check(ticks * core.frequency);
+}
+
+/* returns the master clock ticks until tima next overflows and raises the
+ * timer interrupt, or UINT_MAX if the timer is stopped */
+unsigned int timer_next_event(void) {
+	unsigned int clocks;
+	timer_sync();
+	if (!(read_io(HWREG_TAC) & 0x04))
+		return UINT_MAX;
+	clocks = ((0x100 - read_io(HWREG_TIMA)) * get_tima_period()) - tima_time;
+	return (clocks + core.frequency - 1) / core.frequency;
+}
+
+void timer_save(void) {
+	save_uint("tima_time", tima_time);
+	save_uint("div_time", div_time);
+}
+
+void timer_load(void) {
+	tima_time = 0;
+	div_time = 0;
+	/* older states have no timer phases */
+	if (load_exists("tima_time"))
+		tima_time = load_uint("tima_time");
+	if (load_exists("div_time"))
+		div_time = load_uint("div_time");
+	last_sync = core.clock;
 }
 
-void timer_check(unsigned int period) {
+static void timer_check(unsigned int period) {
 	// check if tima timer is enabled
 	if (read_io(HWREG_TAC) & 0x04) {
 		tima_time += period;
@@ -28,6 +28,9 @@
 #define _TIMER_H
 
 void timer_reset(void);
-void timer_check(unsigned int period);
+void timer_sync(void);
+unsigned int timer_next_event(void);
+void timer_save(void);
+void timer_load(void);
 
 #endif	//_TIMER_H
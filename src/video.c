@@ -0,0 +1,252 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of jonny nor the name of any other
+ *    contributor may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY jonny AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL jonny OR ANY OTHER
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, 
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+ 
+#include <SDL/SDL.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "video.h"
+#include "display.h"
+#include "filter.h"
+#include "stats.h"
+
+/* rows of scaled output a changed source row can reach through the
+ * filters' neighbourhoods */
+#define PRESENT_MARGIN		2
+/* with more changed rows than this a partial update is not worth it */
+#define PRESENT_PARTIAL_MAX	(DISPLAY_H / 2)
+
+typedef struct {
+	const char *name;
+	void (*init)(void);
+	void (*fini)(void);
+	/* shows a finished DISPLAY_W x DISPLAY_H frame */
+	void (*present)(const Frame *frame);
+	/* blanks the output, after a reset */
+	void (*clear)(void);
+} Video;
+
+static void sdl_init(void);
+static void sdl_fini(void);
+static void sdl_present(const Frame *frame);
+static void sdl_clear(void);
+static int line_changed(const Frame *frame, const int y);
+static void line_keep(const Frame *frame, const int y);
+static void headless_init(void);
+static void headless_fini(void);
+static void headless_present(const Frame *frame);
+static void headless_clear(void);
+
+static const Video videos[VIDEO_COUNT] = {
+	{ "sdl", sdl_init, sdl_fini, sdl_present, sdl_clear },
+	{ "headless", headless_init, headless_fini, headless_present, headless_clear }
+};
+static unsigned int video = VIDEO_SDL;
+
+static Counter present_counter = { "frames sent to the screen" };
+static Counter skip_counter = { "presents skipped (unchanged)", .of = &present_counter };
+static Counter partial_counter = { "presents partial", .of = &present_counter };
+static Counter scale_counter = { "frames scaled" };
+
+/* the last frame presented, line by line, so that unchanged frames and
+ * lines are not resolved, scaled and flipped again. only touched by
+ * sdl_present() */
+static Byte last_codes[DISPLAY_H][DISPLAY_W];
+static Palette last_pals[DISPLAY_H][16];
+static Byte is_last_blank[DISPLAY_H];
+static volatile int is_last_frame_valid;
+static unsigned int last_filter;
+/* the last frame presented, in colour, for the filters to scale */
+static SDL_Surface *rgb = NULL;
+
+extern Display display;
+
+void video_set(unsigned int v) {
+	video = v % VIDEO_COUNT;
+}
+
+unsigned int video_get(void) {
+	return video;
+}
+
+/* returns the output called name, or -1 if there is none */
+int video_find(const char *name) {
+	int i;
+	for (i = 0; i < VIDEO_COUNT; i++) {
+		if (strcmp(name, videos[i].name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *video_name(unsigned int v) {
+	return videos[v].name;
+}
+
+void video_init(void) {
+	videos[video].init();
+}
+
+void video_fini(void) {
+	videos[video].fini();
+}
+
+void video_present(const Frame *frame) {
+	counter_inc(&present_counter);
+	videos[video].present(frame);
+}
+
+void video_clear(void) {
+	videos[video].clear();
+}
+
+static void sdl_init(void) {
+	if (SDL_InitSubSystem(SDL_INIT_VIDEO) < 0) {
+		fprintf(stderr, "sdl video initialisation failed: %s\n", SDL_GetError());
+		exit(1);
+	}
+	display.screen = SDL_SetVideoMode(display.x_res, display.y_res, display.bpp, SDL_SWSURFACE);
+	if (display.screen == NULL) {
+		fprintf(stderr, "video mode initialisation failed\n");
+		exit(1);
+	}
+	printf("sdl video initialised.\n");
+	SDL_WM_SetCaption("gbem", "gbem");
+	rgb = display_create_surface();
+	stats_register(&present_counter);
+	stats_register(&skip_counter);
+	stats_register(&partial_counter);
+	stats_register(&scale_counter);
+}
+
+static void sdl_fini(void) {
+	/* the screen belongs to sdl, and goes with SDL_Quit() */
+	display.screen = NULL;
+	SDL_FreeSurface(rgb);
+	rgb = NULL;
+}
+
+/* scales and shows frame. rows which are the same as last time are left
+ * alone: an unchanged frame is not presented at all, and a frame with few
+ * changed rows only scales and updates the bands of the screen around
+ * them */
+static void sdl_present(const Frame *frame) {
+	SDL_Rect rects[DISPLAY_H];
+	int bands[DISPLAY_H][2];
+	Byte is_changed[DISPLAY_H];
+	const unsigned int f = filter_get();
+	uint64_t start;
+	int y, y0, y1, i, changed = 0, n = 0;
+	int is_full = !is_last_frame_valid || (f != last_filter);
+
+	start = stats_now();
+	for (y = 0; y < DISPLAY_H; y++) {
+		is_changed[y] = is_full || line_changed(frame, y);
+		if (is_changed[y]) {
+			line_keep(frame, y);
+			display_resolve_line(frame, y, (Colour *)((Uint8 *)rgb->pixels + (rgb->pitch * y)));
+			changed++;
+		}
+	}
+	is_last_frame_valid = 1;
+	last_filter = f;
+	if (changed == 0) {
+		counter_inc(&skip_counter);
+		return;
+	}
+	if (changed > PRESENT_PARTIAL_MAX)
+		is_full = 1;
+
+	if (is_full) {
+		filter_frame(rgb, display.screen);
+		counter_stop(&scale_counter, start);
+		SDL_Flip(display.screen);
+		return;
+	}
+	/* gather runs of changed rows into bands, widened for the filters
+	 * which read neighbouring rows, and merged where they touch */
+	for (y = 0; y < DISPLAY_H; y++) {
+		if (!is_changed[y])
+			continue;
+		for (y1 = y; (y1 < DISPLAY_H) && is_changed[y1]; y1++)
+			;
+		y0 = y;
+		y = y1;
+		if (f != FILTER_NONE) {
+			y0 = y0 > PRESENT_MARGIN ? y0 - PRESENT_MARGIN : 0;
+			y1 = y1 + PRESENT_MARGIN < DISPLAY_H ? y1 + PRESENT_MARGIN : DISPLAY_H;
+		}
+		if ((n > 0) && (bands[n - 1][1] >= y0)) {
+			bands[n - 1][1] = y1;
+			continue;
+		}
+		bands[n][0] = y0;
+		bands[n][1] = y1;
+		n++;
+	}
+	for (i = 0; i < n; i++)
+		filter_frame_rows(rgb, display.screen, bands[i][0], bands[i][1], &rects[i]);
+	counter_stop(&scale_counter, start);
+	SDL_UpdateRects(display.screen, n, rects);
+	counter_inc(&partial_counter);
+}
+
+/* whether line y of frame differs from the last frame presented */
+static int line_changed(const Frame *frame, const int y) {
+	if (frame->line_pals[y] == LINE_BLANK)
+		return !is_last_blank[y];
+	return is_last_blank[y] || memcmp(last_codes[y], frame->codes[y], DISPLAY_W)
+		|| memcmp(last_pals[y], frame->pals[frame->line_pals[y]], sizeof(last_pals[y]));
+}
+
+static void line_keep(const Frame *frame, const int y) {
+	is_last_blank[y] = frame->line_pals[y] == LINE_BLANK;
+	if (is_last_blank[y])
+		return;
+	memcpy(last_codes[y], frame->codes[y], DISPLAY_W);
+	memcpy(last_pals[y], frame->pals[frame->line_pals[y]], sizeof(last_pals[y]));
+}
+
+static void sdl_clear(void) {
+	SDL_FillRect(display.screen, NULL, SDL_MapRGB(display.screen->format, 0xff, 0xff, 0xff));
+	is_last_frame_valid = 0;
+}
+
+/* frames are left in display.frame, and go no further */
+static void headless_init(void) {
+	display.screen = NULL;
+	printf("headless video initialised.\n");
+}
+
+static void headless_fini(void) {
+}
+
+static void headless_present(const Frame *frame) {
+}
+
+static void headless_clear(void) {
+}